@@ -0,0 +1,87 @@
+#!/bin/sh
+# Benchmark each copy backend across file shapes and filesystems,
+# writing one JSON object per run to stdout.
+#
+# As root, ext4, xfs and btrfs loop images and a tmpfs are made
+# for whichever of them can be; otherwise, or to benchmark existing
+# storage, list directories in BENCH_DIRS.
+#
+#   BENCH_DIRS   space separated directories to use instead of images
+#   BENCH_LARGE  size of the large file in bytes, default 1 GiB
+#   BENCH_REPS   runs of each backend per file, default 3
+#   BENCH_FLAGS  extra bench-copy options, e.g. --cold or --sync
+set -e
+
+BENCH_COPY="${BENCH_COPY:-$(dirname "$0")/bench-copy}"
+BENCH_LARGE="${BENCH_LARGE:-1073741824}"
+BENCH_REPS="${BENCH_REPS:-3}"
+IMAGE_SIZE=$((BENCH_LARGE * 3 + 1073741824))
+
+work="$(mktemp -d "${TMPDIR:-/tmp}/bench.XXXXXX")"
+cleanup() {
+    # make_fs runs in a subshell, so find what it mounted afterwards
+    for m in "$work"/*; do
+        if [ -d "$m" ] && mountpoint -q "$m"; then
+            umount "$m" || true
+        fi
+    done
+    rm -rf "$work"
+}
+trap cleanup EXIT INT TERM
+
+# Make a filesystem of type $1 and print where it's mounted
+make_fs() {
+    mnt="$work/$1"
+    mkdir "$mnt"
+    if [ "$1" = tmpfs ]; then
+        mount -t tmpfs -o size="$IMAGE_SIZE" bench "$mnt" || return 1
+    else
+        command -v "mkfs.$1" >/dev/null || return 1
+        truncate -s "$IMAGE_SIZE" "$work/$1.img"
+        "mkfs.$1" -q "$work/$1.img" >/dev/null 2>&1 \
+            || "mkfs.$1" "$work/$1.img" >/dev/null 2>&1 || return 1
+        mount -o loop "$work/$1.img" "$mnt" || return 1
+    fi
+    echo "$mnt"
+}
+
+if [ -n "$BENCH_DIRS" ]; then
+    dirs="$BENCH_DIRS"
+elif [ "$(id -u)" = 0 ]; then
+    dirs=
+    for fs in ext4 xfs btrfs tmpfs; do
+        if dir="$(make_fs "$fs")"; then
+            dirs="$dirs $dir"
+        else
+            echo "Skipping $fs, couldn't make one" >&2
+        fi
+    done
+else
+    echo "Set BENCH_DIRS or run as root to make filesystem images" >&2
+    exit 2
+fi
+
+for dir in $dirs; do
+    case "$dir" in
+    "$work"/*) fs="$(basename "$dir")" ;;
+    # stat can't tell ext4 from ext2
+    *) fs="$(stat -f -c %T "$dir")" ;;
+    esac
+    src="$(mktemp -d "$dir/bench-src.XXXXXX")"
+    tgt="$(mktemp -d "$dir/bench-tgt.XXXXXX")"
+
+    : >"$src/empty"
+    head -c 4096 /dev/urandom >"$src/4k"
+    head -c 1048576 /dev/urandom >"$src/1m"
+    head -c "$BENCH_LARGE" /dev/urandom >"$src/large"
+    # 4 KiB of data every 64 KiB
+    "$BENCH_COPY" --make-fragmented "$BENCH_LARGE" 65536 "$src/fragmented"
+
+    for shape in empty 4k 1m large fragmented; do
+        "$BENCH_COPY" --reps "$BENCH_REPS" $BENCH_FLAGS \
+            --tag "fs=$fs" --tag "dir=$dir" --tag "shape=$shape" \
+            "$src/$shape" "$tgt"
+    done
+
+    rm -rf "$src" "$tgt"
+done
@@ -0,0 +1,321 @@
+
+/* ISC License                                                              */
+/*                                                                          */
+/* Copyright (c) 2016, Richard Maw                                          */
+/*                                                                          */
+/* Permission to use, copy, modify, and/or distribute this software for any */
+/* purpose with or without fee is hereby granted, provided that the above   */
+/* copyright notice and this permission notice appear in all copies.        */
+/*                                                                          */
+/* THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES */
+/* WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF         */
+/* MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR  */
+/* ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES   */
+/* WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN    */
+/* ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF  */
+/* OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.           */
+
+/* Drive each copy backend directly over a source file and report
+   throughput, system calls and CPU time as one JSON object per run,
+   so results can be collected and compared between builds.
+
+   The source's data extents are planned as for a sparse copy,
+   and each is handed to the backend at explicit offsets. */
+
+#include <errno.h>           /* errno */
+#include <fcntl.h>           /* open, openat, posix_fadvise, O_*, AT_FDCWD */
+#include <getopt.h>          /* struct option, getopt_long */
+#include <stdbool.h>         /* bool, true, false */
+#include <stdio.h>           /* printf, fprintf, putchar, perror */
+#include <stdlib.h>          /* strtoul, strtoull, malloc, free */
+#include <string.h>          /* strcmp, strchr, strndup, strerror, memset */
+#include <sys/resource.h>    /* getrusage, struct rusage */
+#include <sys/stat.h>        /* fstat, struct stat */
+#include <time.h>            /* clock_gettime, struct timespec */
+#include <unistd.h>          /* close, ftruncate, fsync, lseek, pwrite */
+
+#include "copy.h"            /* copy_backend_*, copy_syscalls */
+#include "extents.h"         /* extent_plan_* */
+#include "missing.h"         /* O_TMPFILE */
+
+#define MAX_TAGS 16
+
+struct result {
+    loff_t bytes;                /* data copied, not counting holes */
+    double seconds;
+    double user_seconds;
+    double sys_seconds;
+    unsigned long long syscalls;
+    size_t extents;
+};
+
+static double timespec_seconds(const struct timespec *ts) {
+    return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+static double timeval_seconds(const struct timeval *tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static void print_json_string(const char *s) {
+    putchar('"');
+    for (; *s != '\0'; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            printf("\\%c", c);
+        else if (c < 0x20)
+            printf("\\u%04x", c);
+        else
+            putchar(c);
+    }
+    putchar('"');
+}
+
+/* Copy source into an unnamed file in dir with one backend. */
+static int bench_one(enum copy_backend backend, const char *source,
+                     const char *dir, bool cold, bool sync,
+                     struct result *result) {
+    struct extent_plan plan = { .extents = NULL, };
+    struct timespec start, end;
+    struct rusage ru_start, ru_end;
+    unsigned long long syscalls_start;
+    int srcfd = -1, tgtfd = -1;
+    int ret = -1;
+
+    memset(result, 0, sizeof *result);
+
+    srcfd = open(source, O_RDONLY|O_CLOEXEC);
+    if (srcfd < 0)
+        goto cleanup;
+    tgtfd = open(dir, O_TMPFILE|O_RDWR|O_CLOEXEC, 0600);
+    if (tgtfd < 0)
+        goto cleanup;
+    if (cold)
+        (void)posix_fadvise(srcfd, 0, 0, POSIX_FADV_DONTNEED);
+
+    getrusage(RUSAGE_SELF, &ru_start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    syscalls_start = copy_syscalls;
+
+    ret = extent_plan_build(srcfd, 0, &plan);
+    if (ret < 0)
+        goto cleanup;
+
+    for (size_t i = 0; i < plan.count; i++) {
+        loff_t srcoff = plan.extents[i].offset;
+        loff_t tgtoff = srcoff;
+        loff_t *tgtoffp = &tgtoff;
+        loff_t end_off = srcoff + plan.extents[i].length;
+
+        /* sendfile only writes at the file position */
+        if (backend == COPY_BACKEND_SENDFILE) {
+            if (lseek(tgtfd, tgtoff, SEEK_SET) == (off_t)-1)
+                goto cleanup;
+            tgtoffp = NULL;
+        }
+
+        while (srcoff < end_off) {
+            ssize_t copied = copy_backend_range(backend, srcfd, &srcoff,
+                                                tgtfd, tgtoffp,
+                                                end_off - srcoff);
+            if (copied < 0) {
+                ret = -1;
+                goto cleanup;
+            }
+            if (copied == 0)
+                break;
+            result->bytes += copied;
+        }
+    }
+    result->extents = plan.count;
+
+    ret = ftruncate(tgtfd, plan.size);
+    if (ret == 0 && sync)
+        ret = fsync(tgtfd);
+    if (ret < 0)
+        goto cleanup;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &ru_end);
+    result->syscalls = copy_syscalls - syscalls_start;
+    result->seconds = timespec_seconds(&end) - timespec_seconds(&start);
+    result->user_seconds = timeval_seconds(&ru_end.ru_utime)
+                           - timeval_seconds(&ru_start.ru_utime);
+    result->sys_seconds = timeval_seconds(&ru_end.ru_stime)
+                          - timeval_seconds(&ru_start.ru_stime);
+
+cleanup:
+    extent_plan_free(&plan);
+    if (srcfd >= 0)
+        close(srcfd);
+    if (tgtfd >= 0)
+        close(tgtfd);
+    return ret;
+}
+
+/* Write size bytes of file at path with 4 KiB of data every stride,
+   for a file with as many extents as can be made of it. */
+static int make_fragmented(const char *path, loff_t size, loff_t stride) {
+    char block[4096];
+    int fd, ret = 0;
+
+    for (size_t i = 0; i < sizeof(block); i++)
+        block[i] = i * 31 + 7;
+
+    fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("Create fragmented file");
+        return -1;
+    }
+    for (loff_t off = 0; off < size && ret == 0; off += stride) {
+        if (pwrite(fd, block, sizeof(block), off) != sizeof(block))
+            ret = -1;
+    }
+    if (ret == 0)
+        ret = ftruncate(fd, size);
+    if (ret < 0)
+        perror("Write fragmented file");
+    close(fd);
+    return ret;
+}
+
+static int parse_backend(const char *name) {
+    for (int i = 0; i < COPY_BACKEND_COUNT; i++) {
+        if (strcmp(name, copy_backend_names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+int main(int argc, char *argv[]) {
+    bool backends[COPY_BACKEND_COUNT] = { false, };
+    bool any_backend = false;
+    const char *tags[MAX_TAGS];
+    unsigned ntags = 0;
+    unsigned reps = 3;
+    bool cold = false, sync = false;
+    const char *source, *dir;
+
+    enum opt {
+        OPT_BACKEND = 'b',
+        OPT_REPS = 'r',
+        OPT_TAG = 't',
+        OPT_COLD = 'c',
+        OPT_SYNC = 's',
+        OPT_MAKE_FRAGMENTED = 0x100,
+    };
+    static const struct option opts[] = {
+        { .name = "backend",         .has_arg = required_argument,
+          .val = OPT_BACKEND, },
+        { .name = "reps",            .has_arg = required_argument,
+          .val = OPT_REPS, },
+        { .name = "tag",             .has_arg = required_argument,
+          .val = OPT_TAG, },
+        { .name = "cold",            .has_arg = no_argument,
+          .val = OPT_COLD, },
+        { .name = "sync",            .has_arg = no_argument,
+          .val = OPT_SYNC, },
+        { .name = "make-fragmented", .has_arg = no_argument,
+          .val = OPT_MAKE_FRAGMENTED, },
+        {},
+    };
+
+    for (;;) {
+        int ret = getopt_long(argc, argv, "b:r:t:cs", opts, NULL);
+        if (ret == -1)
+            break;
+        switch (ret) {
+        case '?':
+            return 2;
+        case OPT_BACKEND: {
+            int backend = parse_backend(optarg);
+            if (backend < 0) {
+                fprintf(stderr, "Unknown backend %s\n", optarg);
+                return 2;
+            }
+            backends[backend] = any_backend = true;
+            break;
+        }
+        case OPT_REPS:
+            reps = strtoul(optarg, NULL, 0);
+            break;
+        case OPT_TAG:
+            if (ntags == MAX_TAGS || strchr(optarg, '=') == NULL) {
+                fprintf(stderr, "Tags must be KEY=VALUE, at most %d\n",
+                        MAX_TAGS);
+                return 2;
+            }
+            tags[ntags++] = optarg;
+            break;
+        case OPT_COLD:
+            cold = true;
+            break;
+        case OPT_SYNC:
+            sync = true;
+            break;
+        case OPT_MAKE_FRAGMENTED:
+            if (argc - optind != 3) {
+                fprintf(stderr, "--make-fragmented SIZE STRIDE PATH\n");
+                return 2;
+            }
+            return make_fragmented(argv[optind + 2],
+                                   strtoull(argv[optind], NULL, 0),
+                                   strtoull(argv[optind + 1], NULL, 0))
+                   < 0;
+        }
+    }
+
+    if (argc - optind != 2) {
+        fprintf(stderr, "Usage: bench-copy [OPTIONS] SOURCE TARGET-DIR\n");
+        return 2;
+    }
+    source = argv[optind];
+    dir = argv[optind + 1];
+
+    for (int backend = 0; backend < COPY_BACKEND_COUNT; backend++) {
+        if (any_backend && !backends[backend])
+            continue;
+
+        for (unsigned rep = 1; rep <= reps; rep++) {
+            struct result r;
+            int ret = bench_one(backend, source, dir, cold, sync, &r);
+            int err = errno;
+
+            printf("{");
+            for (unsigned i = 0; i < ntags; i++) {
+                const char *eq = strchr(tags[i], '=');
+                char *key = strndup(tags[i], eq - tags[i]);
+                if (key == NULL)
+                    return 1;
+                print_json_string(key);
+                putchar(':');
+                print_json_string(eq + 1);
+                printf(",");
+                free(key);
+            }
+            printf("\"source\":");
+            print_json_string(source);
+            printf(",\"backend\":\"%s\",\"rep\":%u",
+                   copy_backend_names[backend], rep);
+            if (ret < 0) {
+                /* Unsupported here isn't a failure of the benchmark */
+                printf(",\"error\":");
+                print_json_string(strerror(err));
+                printf("}\n");
+                break;
+            }
+            printf(",\"bytes\":%lld,\"extents\":%zu,\"seconds\":%.6f"
+                   ",\"mib_per_s\":%.1f,\"syscalls\":%llu"
+                   ",\"syscalls_per_gib\":%.1f"
+                   ",\"user_seconds\":%.6f,\"sys_seconds\":%.6f}\n",
+                   (long long)r.bytes, r.extents, r.seconds,
+                   r.seconds > 0 ? r.bytes / r.seconds / (1 << 20) : 0,
+                   r.syscalls,
+                   r.bytes > 0 ? r.syscalls * (double)(1 << 30) / r.bytes : 0,
+                   r.user_seconds, r.sys_seconds);
+        }
+        fflush(stdout);
+    }
+
+    return 0;
+}
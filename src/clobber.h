@@ -15,6 +15,8 @@
 /* ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF  */
 /* OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.           */
 
+#pragma once
+
 enum clobber {
     CLOBBER_PERMITTED     = 'p',
     CLOBBER_REQUIRED      = 'R',
@@ -21,11 +21,12 @@
 #include <sys/types.h>   /* mode_t */
 #include <fcntl.h>       /* AT_*, O_*, open */
 #include <unistd.h>      /* close, unlink */
-#include <stdio.h>       /* rename* */
+#include <stdio.h>       /* rename*, fprintf */
+#include <string.h>      /* strerror */
 #include <limits.h>      /* SSIZE_MAX */
 
 #include "clobber.h"     /* CLOBBER_* */
-#include "copy.h"        /* copy_contents */
+#include "fsops.h"       /* fsops_copy_contents, fsops_last_error */
 #include "missing.h"     /* RENAME_*, SEEK_*, renameat2 */
 
 static int create_file(const char *path, mode_t mode, int flags,
@@ -123,17 +124,20 @@ int main(int argc, char *argv[]) {
     }
 
     if (argc == optind + 1) {
-        int ret = 0;
+        int64_t ret = 0;
         int fd = create_file(argv[optind], 0666, O_WRONLY, clobber);
         if (fd < 0)
             return 1;
 
         do {
-            ret = copy_contents(0, fd);
+            ret = fsops_copy_contents(0, fd, NULL);
         } while (ret > 0);
 
-        if (ret != 0)
+        if (ret != 0) {
+            const struct fsops_error *error = fsops_last_error();
+            fprintf(stderr, "%s: %s\n", error->what, strerror(error->err));
             return 1;
+        }
 
         close(fd);
     } else {
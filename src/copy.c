@@ -15,304 +15,1336 @@
 /* ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF  */
 /* OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.           */
 
-#include <stdlib.h>          /* NULL */
-#include <linux/btrfs.h>     /* BTRFS_IOC_CLONE */
-#include <linux/magic.h>     /* BTRFS_SUPER_MAGIC */
-#include <fcntl.h>           /* splice */
+#include <stdio.h>           /* snprintf */
+#include <stdlib.h>          /* NULL, calloc, free, posix_memalign */
+#include <linux/fs.h>        /* FICLONE, FICLONERANGE, file_clone_range */
+#include <fcntl.h>           /* splice, fcntl, fallocate, F_SETPIPE_SZ */
+#include <linux/falloc.h>    /* FALLOC_FL_* */
+#include <unistd.h>          /* pread, pwrite, pipe2, lseek, ftruncate */
 #include <sys/types.h>       /* off_t, ssize_t */
 #include <sys/sendfile.h>    /* sendfile */
 #include <errno.h>           /* errno, E* */
-#include <stdio.h>           /* perror */
-#include <stdbool.h>         /* true, false */
+#include <stdbool.h>         /* bool, true, false */
 #include <limits.h>          /* SSIZE_MAX */
-#include <sys/vfs.h>         /* ftatfs, struct statfs */
-#include <sys/stat.h>        /* statfs, struct stat */
+#include <sys/stat.h>        /* fstat, struct stat */
 #include <sys/ioctl.h>       /* ioctl */
 
 #include "copy.h"
 #include "missing.h"         /* renameat2, RENAME_*, SEEK_*, copy_file_range */
+#include "uring.h"           /* uring_copy_range */
+#include "extents.h"         /* extent_plan_* */
+#include "pool.h"            /* pool_submit, pool_wait_for, pool_done */
+#include "stats.h"           /* stats_backend, STATS_SYSCALL */
+#include "progress.h"        /* progress_add, progress_backend */
+#include "internal.h"        /* fsops_fail */
+#include "zero.h"            /* buf_is_zero */
+#include "digest.h"          /* digest_add, digest_skip */
+#include "meta.h"            /* file_meta_fd, struct file_meta */
 
-static ssize_t cfr_copy_range(int srcfd, int tgtfd, size_t range) {
+const struct copy_opts copy_opts_default = {
+    .uring_depth = 8,
+    .chunk_size = 64 * 1024 * 1024,
+};
+
+__thread unsigned long long copy_syscalls;
+
+/* The backends copy between explicit offsets, which they advance,
+   or use and move the file positions when an offset pointer is NULL,
+   as copy_file_range does. An error fails the copy with -1
+   even after some of it was done, as far as the offsets show. */
+
+static ssize_t cfr_copy_range(int srcfd, loff_t *srcoff, int tgtfd,
+                              loff_t *tgtoff, size_t range) {
     size_t to_copy = range;
     while (to_copy) {
-        ssize_t ret = copy_file_range(srcfd, NULL, tgtfd, NULL, range, 0);
+        ssize_t ret = copy_file_range(srcfd, srcoff, tgtfd, tgtoff, to_copy, 0);
+        copy_syscalls++;
         if (ret < 0)
             return ret;
+        if (ret == 0)
+            break;
+        progress_add(ret);
         to_copy -= ret;
     }
-    return range;
+    return range - to_copy;
 }
 
-static ssize_t sendfile_copy_range(int srcfd, int tgtfd, size_t range) {
+static ssize_t uring_copy_range_at(int srcfd, loff_t *srcoff, int tgtfd,
+                                   loff_t *tgtoff, size_t range,
+                                   const struct copy_opts *opts) {
+    loff_t srccur, tgtcur;
+    ssize_t ret;
+
+    if (srcoff != NULL && tgtoff != NULL)
+        return uring_copy_range(srcfd, srcoff, tgtfd, tgtoff, range,
+                                opts->uring_depth, 0, opts->digest);
+
+    /* io_uring only works at explicit offsets,
+       so start from and update the file positions. */
+    srccur = srcoff ? *srcoff : TEMP_FAILURE_RETRY(lseek(srcfd, 0, SEEK_CUR));
+    tgtcur = tgtoff ? *tgtoff : TEMP_FAILURE_RETRY(lseek(tgtfd, 0, SEEK_CUR));
+    if (srccur == (off_t)-1 || tgtcur == (off_t)-1) {
+        if (errno == ESPIPE)
+            errno = EINVAL;
+        return -1;
+    }
+
+    ret = uring_copy_range(srcfd, &srccur, tgtfd, &tgtcur, range,
+                           opts->uring_depth, 0, opts->digest);
+    if (ret <= 0)
+        return ret;
+
+    if (srcoff != NULL)
+        *srcoff = srccur;
+    else if (TEMP_FAILURE_RETRY(lseek(srcfd, srccur, SEEK_SET)) == (off_t)-1)
+        goto seek_error;
+    if (tgtoff != NULL)
+        *tgtoff = tgtcur;
+    else if (TEMP_FAILURE_RETRY(lseek(tgtfd, tgtcur, SEEK_SET)) == (off_t)-1)
+        goto seek_error;
+    return ret;
+
+seek_error:
+    fsops_fail("Move past io_uring copy");
+    return -1;
+}
+
+static ssize_t sendfile_copy_range(int srcfd, loff_t *srcoff, int tgtfd,
+                                   loff_t *tgtoff, size_t range) {
     size_t to_copy = range;
+
+    /* sendfile always writes at the target's file position,
+       which chunks copied in parallel can't share,
+       so leave explicit target offsets to splice. */
+    if (tgtoff != NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
     while (to_copy) {
-        ssize_t ret = sendfile(tgtfd, srcfd, NULL, range);
+        ssize_t ret = sendfile(tgtfd, srcfd, srcoff, to_copy);
+        copy_syscalls++;
         if (ret < 0)
             return ret;
+        if (ret == 0)
+            break;
+        progress_add(ret);
         to_copy -= ret;
     }
-    return range;
+
+    return range - to_copy;
 }
 
-static ssize_t splice_copy_range(int srcfd, int tgtfd, size_t range) {
+/* splice needs a pipe on one side, so go through one of our own. */
+static ssize_t splice_copy_range(int srcfd, loff_t *srcoff, int tgtfd,
+                                 loff_t *tgtoff, size_t range) {
     size_t to_copy = range;
+    int pipefd[2];
+    int saved_errno;
+
+    if (pipe2(pipefd, O_CLOEXEC) < 0)
+        return -1;
+    /* A bigger pipe means fewer round trips, but isn't required */
+    (void)fcntl(pipefd[1], F_SETPIPE_SZ, 1024 * 1024);
+    copy_syscalls += 4;          /* including closing the pipe */
+
     while (to_copy) {
-        ssize_t ret = splice(srcfd, NULL, tgtfd, NULL, range, 0);
-        if (ret < 0)
-            return ret;
-        to_copy -= ret;
+        ssize_t in = splice(srcfd, srcoff, pipefd[1], NULL, to_copy,
+                            SPLICE_F_MOVE);
+        copy_syscalls++;
+        if (in < 0)
+            goto error;
+        if (in == 0)
+            break;
+        while (in > 0) {
+            ssize_t out = splice(pipefd[0], NULL, tgtfd, tgtoff, in,
+                                 SPLICE_F_MOVE);
+            copy_syscalls++;
+            if (out <= 0) {
+                if (out == 0)
+                    errno = EIO;
+                /* What's left in our pipe has to be read again,
+                   which can't be done if the source was a pipe too. */
+                if (srcoff != NULL)
+                    *srcoff -= in;
+                else if (errno == EINVAL)
+                    errno = EIO;
+                goto error;
+            }
+            progress_add(out);
+            in -= out;
+            to_copy -= out;
+        }
     }
-    return range;
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return range - to_copy;
+
+error:
+    saved_errno = errno;
+    close(pipefd[0]);
+    close(pipefd[1]);
+    errno = saved_errno;
+    return -1;
 }
 
-static ssize_t naive_copy_range(int srcfd, int tgtfd, size_t range) {
+/* Where naive_copy_range leaves holes for blocks of zeros in the target. */
+struct sparse_target {
+    blksize_t blksize;
+    loff_t size;                 /* what the target's size has been made */
+    loff_t end;                  /* furthest offset written or skipped */
+};
+
+static int sparse_target_init(int tgtfd, struct sparse_target *st) {
+    struct stat tgtst;
+
+    copy_syscalls++;
+    if (fstat(tgtfd, &tgtst) < 0)
+        return -1;
+    if (!S_ISREG(tgtst.st_mode)) {
+        errno = EINVAL;
+        return -1;
+    }
+    st->blksize = tgtst.st_blksize > 0 ? tgtst.st_blksize : 4096;
+    st->size = tgtst.st_size;
+    st->end = 0;
+    return 0;
+}
+
+static int punch_hole(int fd, loff_t offset, loff_t len) {
+    copy_syscalls++;
+    return fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, offset, len);
+}
+
+/* Write len bytes from buf at offset in tgtfd a target block at a time,
+   leaving out blocks of zeros: past the end of the target they're skipped
+   and before it they're punched out, or written if that's not supported.
+   Returns how many bytes were dealt with, short only if a write was. */
+static ssize_t write_sparse(int tgtfd, const char *buf, size_t len,
+                            loff_t offset, struct sparse_target *st) {
+    size_t done = 0;
+
+    while (done < len) {
+        bool zero = false;
+        size_t run = 0;
+        ssize_t ret;
+
+        /* Gather blocks while they're all zeros or all not */
+        while (done + run < len) {
+            size_t block = st->blksize - (offset + done + run) % st->blksize;
+            bool block_zero;
+            if (block > len - done - run)
+                block = len - done - run;
+            block_zero = buf_is_zero(buf + done + run, block);
+            if (run != 0 && block_zero != zero)
+                break;
+            zero = block_zero;
+            run += block;
+        }
+
+        if (zero && offset + (loff_t)done >= st->size) {
+            ret = run;
+        } else if (zero && punch_hole(tgtfd, offset + done, run) == 0) {
+            ret = run;
+        } else {
+            ret = TEMP_FAILURE_RETRY(pwrite(tgtfd, buf + done, run,
+                                            offset + done));
+            copy_syscalls++;
+            if (ret < 0)
+                return done > 0 ? (ssize_t)done : ret;
+            if (offset + done + ret > st->size)
+                st->size = offset + done + ret;
+        }
+        progress_add(ret);
+        done += ret;
+        if ((size_t)ret < run)
+            break;
+    }
+
+    if (offset + (loff_t)done > st->end)
+        st->end = offset + done;
+    return done;
+}
+
+/* With opts->sparse_always, blocks of zeros read from the source
+   are left as holes in the target rather than written.
+   What's read is added to opts->digest. */
+static ssize_t naive_copy_range(int srcfd, loff_t *srcoff, int tgtfd,
+                                loff_t *tgtoff, size_t range,
+                                const struct copy_opts *opts) {
     char buf[4 * 1024 * 1024];
+    struct sparse_target sparse = { 0 };
+    bool use_sparse = false;
+    loff_t tgtpos = -1;
+    loff_t srcpos = -1;
+    ssize_t ret = -1;
     size_t copied = 0;
+
+    if (opts->sparse_always && sparse_target_init(tgtfd, &sparse) == 0) {
+        /* Holes need explicit offsets, so use and then set the position */
+        if (tgtoff == NULL) {
+            tgtpos = TEMP_FAILURE_RETRY(lseek(tgtfd, 0, SEEK_CUR));
+            copy_syscalls++;
+            if (tgtpos != (off_t)-1)
+                tgtoff = &tgtpos;
+        }
+        use_sparse = tgtoff != NULL;
+    }
+
+    /* Reads from the file position need it known to be placed in a digest */
+    if (opts->digest != NULL && srcoff == NULL) {
+        srcpos = TEMP_FAILURE_RETRY(lseek(srcfd, 0, SEEK_CUR));
+        copy_syscalls++;
+        if (srcpos == (off_t)-1)
+            digest_skip(opts->digest);
+    }
+
     while (range > copied) {
         size_t to_copy = range - copied;
         ssize_t n_read;
-        n_read = TEMP_FAILURE_RETRY(read(srcfd, buf,
-                to_copy > sizeof(buf) ? sizeof(buf) : to_copy));
+        if (to_copy > sizeof(buf))
+            to_copy = sizeof(buf);
+        if (srcoff != NULL)
+            n_read = TEMP_FAILURE_RETRY(pread(srcfd, buf, to_copy, *srcoff));
+        else
+            n_read = TEMP_FAILURE_RETRY(read(srcfd, buf, to_copy));
+        copy_syscalls++;
         if (n_read < 0) {
-            perror("Read source file");
-            return n_read;
+            fsops_fail("Read source file");
+            goto out;
         }
         if (n_read == 0)
             break;
+        if (opts->digest != NULL && srcoff != NULL) {
+            digest_add(opts->digest, *srcoff, buf, n_read);
+        } else if (opts->digest != NULL && srcpos != (off_t)-1) {
+            digest_add(opts->digest, srcpos, buf, n_read);
+            srcpos += n_read;
+        }
+        if (srcoff != NULL)
+            *srcoff += n_read;
 
-        while (n_read > 0) {
-            ssize_t n_written = TEMP_FAILURE_RETRY(write(tgtfd, buf, n_read));
-            if (n_written < 0)
-                perror("Write to target file");
-                return n_written;
+        if (use_sparse) {
+            ssize_t n_written = write_sparse(tgtfd, buf, n_read, *tgtoff,
+                                             &sparse);
+            if (n_written < 0) {
+                fsops_fail("Write to target file");
+                goto out;
+            }
+            *tgtoff += n_written;
+            copied += n_written;
+            if (n_written < n_read) {
+                errno = EIO;
+                fsops_fail("Write to target file");
+                goto out;
+            }
+            continue;
+        }
+
+        for (char *p = buf; n_read > 0;) {
+            ssize_t n_written;
+            if (tgtoff != NULL)
+                n_written = TEMP_FAILURE_RETRY(pwrite(tgtfd, p, n_read,
+                                                      *tgtoff));
+            else
+                n_written = TEMP_FAILURE_RETRY(write(tgtfd, p, n_read));
+            copy_syscalls++;
+            if (n_written < 0) {
+                fsops_fail("Write to target file");
+                goto out;
+            }
 
+            if (tgtoff != NULL)
+                *tgtoff += n_written;
+            progress_add(n_written);
+            p += n_written;
             n_read -= n_written;
             copied += n_written;
         }
     }
+    ret = copied;
+
+out:
+    if (use_sparse && ret >= 0) {
+        /* Zeros skipped at the end still have to be in the file */
+        if (sparse.end > sparse.size) {
+            copy_syscalls++;
+            if (TEMP_FAILURE_RETRY(ftruncate(tgtfd, sparse.end)) < 0) {
+                fsops_fail("Extend target over skipped zeros");
+                ret = -1;
+            }
+        }
+        if (tgtoff == &tgtpos) {
+            copy_syscalls++;
+            if (TEMP_FAILURE_RETRY(lseek(tgtfd, tgtpos, SEEK_SET))
+                == (off_t)-1) {
+                fsops_fail("Move past copied data");
+                ret = -1;
+            }
+        }
+    }
+    return ret;
+}
+
+/* O_DIRECT needs offsets, lengths and buffers aligned to the device's
+   logical block size, which is no more than a page anywhere we run. */
+#define DIRECT_ALIGN 4096
+#define DIRECT_BUF_SIZE (1024 * 1024)
+
+/* Open fd again with O_DIRECT, since setting it on fd itself
+   would change how everything else using fd reads or writes.
+   Fails with EOPNOTSUPP if the filesystem won't do O_DIRECT. */
+static int reopen_direct(int fd, int flags) {
+    char path[sizeof "/proc/self/fd/" + 3 * sizeof(int)];
+    int ret;
+
+    snprintf(path, sizeof path, "/proc/self/fd/%d", fd);
+    ret = open(path, flags|O_DIRECT|O_CLOEXEC);
+    copy_syscalls++;
+    if (ret < 0 && errno == EINVAL)
+        errno = EOPNOTSUPP;
+    return ret;
+}
+
+/* Copy range bytes of whole blocks between files opened with O_DIRECT
+   through one aligned buffer, when io_uring can't be used. */
+static ssize_t direct_rw_range(int srcfd, loff_t *srcoff, int tgtfd,
+                               loff_t *tgtoff, size_t range,
+                               struct digest *digest) {
+    char *buf = NULL;
+    size_t copied = 0;
+    int saved_errno;
+
+    errno = posix_memalign((void **)&buf, DIRECT_ALIGN, DIRECT_BUF_SIZE);
+    if (errno != 0)
+        return -1;
+
+    while (copied < range) {
+        size_t to_copy = range - copied;
+        ssize_t n_read;
+        if (to_copy > DIRECT_BUF_SIZE)
+            to_copy = DIRECT_BUF_SIZE;
+        n_read = TEMP_FAILURE_RETRY(pread(srcfd, buf, to_copy, *srcoff));
+        copy_syscalls++;
+        if (n_read < 0)
+            goto error;
+        if (n_read == 0)
+            break;
+
+        /* A short read is only at EOF, so is where the blocks end */
+        for (ssize_t done = 0; done < n_read;) {
+            ssize_t n_written = TEMP_FAILURE_RETRY(
+                pwrite(tgtfd, buf + done, n_read - done, *tgtoff + done));
+            copy_syscalls++;
+            if (n_written < 0)
+                goto error;
+            done += n_written;
+        }
+        /* Only once written, since a failure is copied again elsewhere */
+        if (digest != NULL)
+            digest_add(digest, *srcoff, buf, n_read);
+        progress_add(n_read);
+        *srcoff += n_read;
+        *tgtoff += n_read;
+        copied += n_read;
+        if ((size_t)n_read < to_copy)
+            break;
+    }
+    free(buf);
     return copied;
+
+error:
+    saved_errno = errno;
+    free(buf);
+    errno = saved_errno;
+    return -1;
 }
 
-static ssize_t copy_range(int srcfd, int tgtfd, size_t range) {
-    ssize_t copied;
-    static int have_cfr = true, have_sendfile = true, have_splice = true;
+/* Copy without going through the page cache, so moving a huge file
+   doesn't push everyone else's data out of it.
+   Whole blocks are copied through io_uring between the files opened again
+   with O_DIRECT, reading some buffers while others are written.
+   The tail of the file after the last whole block goes through the cache,
+   since O_DIRECT can't write part of a block.
+   Fails with EINVAL unless the offsets are explicit and block aligned,
+   or EOPNOTSUPP if either filesystem won't do O_DIRECT. */
+static ssize_t direct_copy_range(int srcfd, loff_t *srcoff, int tgtfd,
+                                 loff_t *tgtoff, size_t range,
+                                 const struct copy_opts *opts) {
+    struct copy_opts tail_opts = *opts;
+    struct stat st;
+    int dsrcfd = -1;
+    int dtgtfd = -1;
+    size_t blocks;
+    ssize_t copied = 0;
+    ssize_t ret;
 
-    if (have_cfr) {
-        copied = cfr_copy_range(srcfd, tgtfd, range);
-        if (copied >= 0) {
-            return copied;
-        } else if (errno == ENOSYS) {
-            have_cfr = false;
-        } else if (errno != EINVAL) {
+    if (srcoff == NULL || tgtoff == NULL || *srcoff % DIRECT_ALIGN != 0
+        || *tgtoff % DIRECT_ALIGN != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    copy_syscalls++;
+    if (fstat(srcfd, &st) < 0)
+        return -1;
+    if (!S_ISREG(st.st_mode)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (*srcoff >= st.st_size)
+        return 0;
+    if (range > st.st_size - *srcoff)
+        range = st.st_size - *srcoff;
+    blocks = range / DIRECT_ALIGN * DIRECT_ALIGN;
+
+    if (blocks > 0) {
+        /* Two buffers at least, so one is read while another is written */
+        unsigned depth = opts->uring_depth < 2 ? 2 : opts->uring_depth;
+        int saved_errno;
+
+        dsrcfd = reopen_direct(srcfd, O_RDONLY);
+        if (dsrcfd >= 0)
+            dtgtfd = reopen_direct(tgtfd, O_WRONLY);
+        if (dtgtfd < 0) {
+            saved_errno = errno;
+            if (dsrcfd >= 0)
+                close(dsrcfd);
+            errno = saved_errno;
+            return -1;
+        }
+
+        copied = -1;
+        if (opts->uring_depth != 0)
+            copied = uring_copy_range(dsrcfd, srcoff, dtgtfd, tgtoff, blocks,
+                                      depth, DIRECT_ALIGN, opts->digest);
+        /* io_uring isn't there, or won't do O_DIRECT for these files */
+        if (copied < 0 && (opts->uring_depth == 0 || errno == ENOSYS
+                           || errno == EINVAL || errno == EOPNOTSUPP))
+            copied = direct_rw_range(dsrcfd, srcoff, dtgtfd, tgtoff, blocks,
+                                     opts->digest);
+        saved_errno = errno;
+        close(dsrcfd);
+        close(dtgtfd);
+        copy_syscalls += 2;
+        errno = saved_errno;
+        if (copied < 0)
             return copied;
+    }
+
+    /* Whatever wasn't whole blocks, which is only the tail
+       unless the source shrank or ended early */
+    if (range > (size_t)copied) {
+        tail_opts.sparse_always = false;
+        ret = naive_copy_range(srcfd, srcoff, tgtfd, tgtoff, range - copied,
+                               &tail_opts);
+        if (ret < 0)
+            return ret;
+        copied += ret;
+    }
+    return copied;
+}
+
+/* Share the range's extents rather than copying,
+   which only works at explicit offsets. */
+static ssize_t clone_copy_range(int srcfd, loff_t *srcoff, int tgtfd,
+                                loff_t *tgtoff, size_t range) {
+    struct file_clone_range fcr;
+
+    if (srcoff == NULL || tgtoff == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    fcr.src_fd = srcfd;
+    fcr.src_offset = *srcoff;
+    fcr.src_length = range;
+    fcr.dest_offset = *tgtoff;
+    copy_syscalls++;
+    if (ioctl(tgtfd, FICLONERANGE, &fcr) < 0)
+        return -1;
+    progress_add(range);
+    *srcoff += range;
+    *tgtoff += range;
+    return range;
+}
+
+/* Backends the kernel turned out not to have, as bits of 1 << backend.
+   Shared by every thread without locking, since bits are only ever set. */
+static unsigned missing_backends;
+
+static bool backend_missing(enum copy_backend backend) {
+    return __atomic_load_n(&missing_backends, __ATOMIC_RELAXED)
+           & (1u << backend);
+}
+
+/* What has been learned about copying between a pair of filesystems,
+   so only the first file between them pays for finding out.
+   Slots are claimed with a compare and swap and only read once ready,
+   and what's learned is updated atomically, so no lock is needed. */
+#define PAIR_CACHE_SLOTS 256
+
+enum pair_state {
+    PAIR_EMPTY,
+    PAIR_CLAIMED,                /* being filled in by whoever claimed it */
+    PAIR_READY,
+};
+
+struct pair_caps {
+    dev_t src;
+    dev_t tgt;
+    unsigned state;              /* enum pair_state */
+    unsigned backend;            /* that last worked, AUTO until one has */
+    bool no_clone;               /* the filesystems can't share extents */
+    bool no_direct;              /* one of them won't do O_DIRECT */
+    bool no_uring;               /* io_uring refused requests between them */
+    bool no_fallocate;           /* the target's can't preallocate */
+};
+
+static struct pair_caps pair_cache[PAIR_CACHE_SLOTS];
+
+/* Find or add the entry for copying from src to tgt.
+   Returns NULL if the cache is full, when everything is probed each time. */
+static struct pair_caps *pair_caps_get(dev_t src, dev_t tgt) {
+    size_t start = (src * 2654435761u ^ tgt) % PAIR_CACHE_SLOTS;
+
+    for (size_t i = 0; i < PAIR_CACHE_SLOTS; i++) {
+        struct pair_caps *caps = &pair_cache[(start + i) % PAIR_CACHE_SLOTS];
+        unsigned state = __atomic_load_n(&caps->state, __ATOMIC_ACQUIRE);
+
+        if (state == PAIR_EMPTY
+            && __atomic_compare_exchange_n(&caps->state, &state,
+                                           PAIR_CLAIMED, false,
+                                           __ATOMIC_ACQUIRE,
+                                           __ATOMIC_ACQUIRE)) {
+            caps->src = src;
+            caps->tgt = tgt;
+            __atomic_store_n(&caps->state, PAIR_READY, __ATOMIC_RELEASE);
+            return caps;
         }
+        /* Only a couple of stores away from being ready */
+        while (state == PAIR_CLAIMED)
+            state = __atomic_load_n(&caps->state, __ATOMIC_ACQUIRE);
+        if (caps->src == src && caps->tgt == tgt)
+            return caps;
+    }
+    return NULL;
+}
+
+static ssize_t backend_range(enum copy_backend backend, int srcfd,
+                             loff_t *srcoff, int tgtfd, loff_t *tgtoff,
+                             size_t range, const struct copy_opts *opts) {
+    switch (backend) {
+    case COPY_BACKEND_CFR:
+        return cfr_copy_range(srcfd, srcoff, tgtfd, tgtoff, range);
+    case COPY_BACKEND_URING:
+        return uring_copy_range_at(srcfd, srcoff, tgtfd, tgtoff, range, opts);
+    case COPY_BACKEND_SENDFILE:
+        return sendfile_copy_range(srcfd, srcoff, tgtfd, tgtoff, range);
+    case COPY_BACKEND_SPLICE:
+        return splice_copy_range(srcfd, srcoff, tgtfd, tgtoff, range);
+    case COPY_BACKEND_NAIVE:
+        return naive_copy_range(srcfd, srcoff, tgtfd, tgtoff, range, opts);
+    case COPY_BACKEND_CLONE:
+        return clone_copy_range(srcfd, srcoff, tgtfd, tgtoff, range);
+    case COPY_BACKEND_DIRECT:
+        return direct_copy_range(srcfd, srcoff, tgtfd, tgtoff, range, opts);
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+}
+
+/* Whether backend failing with err means trying the next one,
+   rather than a real error copying these files.
+   A system call the kernel lacks isn't tried again by anyone,
+   but io_uring also reports ENOSYS when it's turned off for this copy. */
+static bool backend_refused(enum copy_backend backend, int err) {
+    switch (backend) {
+    case COPY_BACKEND_CFR:
+    case COPY_BACKEND_SENDFILE:
+    case COPY_BACKEND_SPLICE:
+        if (err == ENOSYS)
+            __atomic_fetch_or(&missing_backends, 1u << backend,
+                              __ATOMIC_RELAXED);
+        return err == ENOSYS || err == EINVAL
+               || (backend == COPY_BACKEND_CFR && err == EXDEV);
+    case COPY_BACKEND_URING:
+        return err == ENOSYS || err == EINVAL || err == EOPNOTSUPP;
+    default:
+        return false;
+    }
+}
+
+/* Whether backend is known not to work between the pair's filesystems,
+   beyond being missing from the kernel altogether. */
+static bool pair_refuses(struct pair_caps *caps, enum copy_backend backend) {
+    return backend == COPY_BACKEND_URING && caps != NULL
+           && __atomic_load_n(&caps->no_uring, __ATOMIC_RELAXED);
+}
+
+/* Remember that backend refused to copy between the pair's filesystems
+   with err, rather than being unavailable to everyone, which for io_uring
+   is only some kinds of request, so isn't held against other files. */
+static void pair_refused(struct pair_caps *caps, enum copy_backend backend,
+                         int err) {
+    if (backend == COPY_BACKEND_URING && err != ENOSYS && caps != NULL)
+        __atomic_store_n(&caps->no_uring, true, __ATOMIC_RELAXED);
+}
+
+/* Note the data a backend copied without it passing through our buffers,
+   which has to be read back to be checked. */
+static void note_unseen(enum copy_backend backend, ssize_t copied,
+                        const struct copy_opts *opts) {
+    if (opts->digest != NULL && copied > 0 && backend != COPY_BACKEND_URING
+        && backend != COPY_BACKEND_NAIVE && backend != COPY_BACKEND_DIRECT)
+        digest_skip(opts->digest);
+}
+
+/* The order backends are tried in. Queued reads and writes come next
+   to keep the devices busy where the kernel can't copy between the files. */
+static const enum copy_backend backend_order[] = {
+    COPY_BACKEND_CFR,
+    COPY_BACKEND_URING,
+    COPY_BACKEND_SENDFILE,
+    COPY_BACKEND_SPLICE,
+    COPY_BACKEND_NAIVE,
+};
+
+/* How much of a range starting at start a backend that gave up
+   has already copied, which only explicit offsets tell. */
+static size_t range_done(const loff_t *srcoff, loff_t start) {
+    return srcoff != NULL ? *srcoff - start : 0;
+}
+
+/* Copy with the backend that last worked between the files' filesystems,
+   or try each in turn if that isn't known or no longer works,
+   remembering the one that does in caps, which may be NULL.
+   A backend that gives up partway is carried on from by the next. */
+static ssize_t copy_range(int srcfd, loff_t *srcoff, int tgtfd, loff_t *tgtoff,
+                          size_t range, const struct copy_opts *opts,
+                          struct pair_caps *caps) {
+    enum copy_backend known = COPY_BACKEND_AUTO;
+    loff_t start = srcoff != NULL ? *srcoff : 0;
+    ssize_t copied = -1;
+    size_t done = 0;
+
+    /* Only the read and write path sees the data to find zeros in */
+    if (opts->sparse_always) {
+        progress_backend(COPY_BACKEND_NAIVE);
+        copied = naive_copy_range(srcfd, srcoff, tgtfd, tgtoff, range, opts);
+        if (copied >= 0)
+            stats_backend(COPY_BACKEND_NAIVE, copied);
+        return copied;
     }
 
-    if (have_sendfile) {
-        copied = sendfile_copy_range(srcfd, tgtfd, range);
+    /* Kept out of the page cache if asked and the filesystems allow it,
+       and through it otherwise, or if the range isn't block aligned */
+    if (opts->direct && !(caps != NULL
+                          && __atomic_load_n(&caps->no_direct,
+                                             __ATOMIC_RELAXED))) {
+        progress_backend(COPY_BACKEND_DIRECT);
+        copied = direct_copy_range(srcfd, srcoff, tgtfd, tgtoff, range, opts);
         if (copied >= 0) {
+            stats_backend(COPY_BACKEND_DIRECT, copied);
             return copied;
-        } else if (errno == ENOSYS) {
-            have_sendfile = false;
-        } else if (errno != EINVAL) {
+        } else if (errno == EOPNOTSUPP && caps != NULL) {
+            __atomic_store_n(&caps->no_direct, true, __ATOMIC_RELAXED);
+        } else if (errno != EOPNOTSUPP && errno != EINVAL) {
             return copied;
         }
+        done = range_done(srcoff, start);
     }
 
-    if (have_splice) {
-        copied = splice_copy_range(srcfd, tgtfd, range);
+    if (caps != NULL)
+        known = __atomic_load_n(&caps->backend, __ATOMIC_RELAXED);
+    if (known != COPY_BACKEND_AUTO) {
+        progress_backend(known);
+        copied = backend_range(known, srcfd, srcoff, tgtfd, tgtoff,
+                               range - done, opts);
         if (copied >= 0) {
+            stats_backend(known, copied);
+            note_unseen(known, copied, opts);
+            return done + copied;
+        } else if (!backend_refused(known, errno)) {
             return copied;
-        } else if (errno == ENOSYS) {
-            have_splice = false;
-        } else if (errno != EINVAL) {
+        }
+        pair_refused(caps, known, errno);
+        note_unseen(known, range_done(srcoff, start) - done, opts);
+        done = range_done(srcoff, start);
+    }
+
+    for (size_t i = 0; i < sizeof backend_order / sizeof *backend_order; i++) {
+        enum copy_backend backend = backend_order[i];
+        if (backend == known || backend_missing(backend)
+            || pair_refuses(caps, backend))
+            continue;
+
+        progress_backend(backend);
+        copied = backend_range(backend, srcfd, srcoff, tgtfd, tgtoff,
+                               range - done, opts);
+        if (copied >= 0) {
+            stats_backend(backend, copied);
+            note_unseen(backend, copied, opts);
+            if (caps != NULL)
+                __atomic_store_n(&caps->backend, backend, __ATOMIC_RELAXED);
+            return done + copied;
+        } else if (!backend_refused(backend, errno)) {
             return copied;
         }
+        pair_refused(caps, backend, errno);
+        note_unseen(backend, range_done(srcoff, start) - done, opts);
+        done = range_done(srcoff, start);
     }
+    return copied;
+}
+
+const char *const copy_backend_names[COPY_BACKEND_COUNT] = {
+    [COPY_BACKEND_AUTO] = "auto",
+    [COPY_BACKEND_CFR] = "copy_file_range",
+    [COPY_BACKEND_URING] = "io_uring",
+    [COPY_BACKEND_SENDFILE] = "sendfile",
+    [COPY_BACKEND_SPLICE] = "splice",
+    [COPY_BACKEND_NAIVE] = "read_write",
+    [COPY_BACKEND_CLONE] = "clone",
+    [COPY_BACKEND_DIRECT] = "direct",
+};
 
-    return naive_copy_range(srcfd, tgtfd, range);
+ssize_t copy_backend_range(enum copy_backend backend, int srcfd,
+                           loff_t *srcoff, int tgtfd, loff_t *tgtoff,
+                           size_t range) {
+    if (backend == COPY_BACKEND_AUTO)
+        return copy_range(srcfd, srcoff, tgtfd, tgtoff, range,
+                          &copy_opts_default, NULL);
+    return backend_range(backend, srcfd, srcoff, tgtfd, tgtoff, range,
+                         &copy_opts_default);
 }
 
-static int naive_contents_copy(int srcfd, int tgtfd) {
+static ssize_t naive_contents_copy(int srcfd, int tgtfd,
+                                   const struct copy_opts *opts,
+                                   struct pair_caps *caps) {
     ssize_t ret;
     ssize_t copied = 0;
+    /* Keep going until nothing more is copied,
+       since a pipe may return short copies before EOF. */
     do {
-        ret = copy_range(srcfd, tgtfd, SSIZE_MAX);
+        ret = copy_range(srcfd, NULL, tgtfd, NULL, SSIZE_MAX, opts, caps);
         if (ret < 0)
             return ret;
         copied += ret;
-    } while (ret != SSIZE_MAX);
+    } while (ret != 0);
     return copied;
-} 
+}
 
-static ssize_t sparse_copy_contents(int srcfd, int tgtfd) {
-    size_t copied = 0;
-    off_t srcoffs = (off_t)-1;
-    off_t nextoffs = (off_t)-1;
-
-    srcoffs = TEMP_FAILURE_RETRY(lseek(srcfd, 0, SEEK_CUR));
-    if (srcoffs == (off_t)-1) {
-        perror("Find current position of file");
-        /* Can't seek file, could be file isn't seekable,
-           or that the current offset would overflow. */
+/* Check that a copy that stopped short at offset did so because
+   the source ends there, which is all a short copy should mean.
+   Fails with EIO if there's more of it, so nothing is cut off
+   on the strength of a copy that went wrong. */
+static int confirm_eof(int srcfd, loff_t offset) {
+    struct stat st;
+
+    if (STATS_SYSCALL(fstat(srcfd, &st)) < 0)
+        return -1;
+    if (st.st_size > offset) {
+        errno = EIO;
         return -1;
     }
+    return 0;
+}
 
-    nextoffs = TEMP_FAILURE_RETRY(lseek(srcfd, srcoffs, SEEK_DATA));
-    if (nextoffs == (off_t)-1) {
-        if (errno == ENXIO) {
-            /* NXIO means EOF, there is no data to copy,
-               but we may need to make a hole to the end of the file */
-            goto end_hole;
-        }
-        perror("Find data or hole at beginning of file");
-        /* Error seeking, must not support sparse seek */
-        return -1;
+/* Data extents are split into chunks that pool workers copy at once,
+   since one stream only reaches a fraction of striped or NVMe bandwidth. */
+struct chunked_copy {
+    const struct copy_opts *opts;
+    struct pair_caps *caps;
+    int srcfd;
+    int tgtfd;
+    loff_t delta;                /* target offset minus source offset */
+    unsigned long outstanding;   /* chunks not yet finished */
+    size_t copied;
+    loff_t eof;                  /* lowest offset a chunk ended short at */
+    int error;                   /* errno of the first failed chunk */
+    unsigned long long syscalls; /* made by whichever threads ran chunks */
+};
+
+struct chunk {
+    struct chunked_copy *cc;
+    loff_t offset;
+    size_t length;
+};
+
+static void copy_chunk(struct pool *pool, void *arg) {
+    struct chunk *chunk = arg;
+    struct chunked_copy *cc = chunk->cc;
+    loff_t srcoff = chunk->offset;
+    loff_t tgtoff = chunk->offset + cc->delta;
+    unsigned long long syscalls = copy_syscalls;
+    ssize_t ret;
+
+    /* Don't bother with the rest once one chunk has failed */
+    if (__atomic_load_n(&cc->error, __ATOMIC_RELAXED) != 0)
+        goto done;
+
+    ret = copy_range(cc->srcfd, &srcoff, cc->tgtfd, &tgtoff, chunk->length,
+                     cc->opts, cc->caps);
+    if (ret >= 0 && (size_t)ret < chunk->length
+        && confirm_eof(cc->srcfd, srcoff) < 0)
+        ret = -1;
+
+    /* Counted for the thread the copy was started on instead */
+    syscalls = copy_syscalls - syscalls;
+    copy_syscalls -= syscalls;
+    __atomic_fetch_add(&cc->syscalls, syscalls, __ATOMIC_RELAXED);
+
+    if (ret < 0) {
+        int expected = 0;
+        __atomic_compare_exchange_n(&cc->error, &expected, errno, false,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+        goto done;
     }
 
-    if (srcoffs != nextoffs)
-        /* Seeked to the end of a hole, can skip a data copy. */
-        goto hole;
+    __atomic_fetch_add(&cc->copied, ret, __ATOMIC_RELAXED);
+    if ((size_t)ret < chunk->length) {
+        /* Truncated since planning, so this may be the new EOF */
+        loff_t eof = __atomic_load_n(&cc->eof, __ATOMIC_SEQ_CST);
+        while (srcoff < eof
+               && !__atomic_compare_exchange_n(&cc->eof, &eof, srcoff, false,
+                                               __ATOMIC_SEQ_CST,
+                                               __ATOMIC_SEQ_CST))
+            ;
+    }
 
-    for (;;) {
-        ssize_t ret;
-        /* In data, so we must find the end of the data then copy it,
-           could pread/write. */
-        nextoffs = TEMP_FAILURE_RETRY(lseek(srcfd, srcoffs, SEEK_HOLE));
-        if (nextoffs == (off_t)-1) {
-            if (errno != ENXIO) {
-                perror("Find end of data");
-                return -1;
-            }
+done:
+    pool_done(pool, &cc->outstanding);
+}
 
-            /* EOF after data, but we still need to copy */
-            goto end_data;
-        }
+/* Copy the extents in plan using opts->pool, shifted by delta in tgtfd.
+   The calling thread runs chunks too while it waits for the rest.
+   plan->size is lowered if the source is found to be truncated. */
+static ssize_t chunked_copy(int srcfd, int tgtfd, loff_t delta,
+                            struct extent_plan *plan,
+                            const struct copy_opts *opts,
+                            struct pair_caps *caps) {
+    struct chunked_copy cc = {
+        .opts = opts, .caps = caps, .srcfd = srcfd, .tgtfd = tgtfd,
+        .delta = delta, .eof = plan->size,
+    };
+    const size_t chunk_size = opts->chunk_size;
+    struct chunk *chunks = NULL;
+    size_t nchunks = 0, submitted = 0;
+    ssize_t ret = -1;
 
-        srcoffs = TEMP_FAILURE_RETRY(lseek(srcfd, srcoffs, SEEK_SET));
-        if (srcoffs == (off_t)-1) {
-            /* Rewinding failed, something is *very* strange. */
-            perror("Rewind back to data");
-            return -1;
+    for (size_t i = 0; i < plan->count; i++)
+        nchunks += (plan->extents[i].length + chunk_size - 1) / chunk_size;
+
+    chunks = calloc(nchunks, sizeof *chunks);
+    if (chunks == NULL)
+        return ret;
+
+    for (size_t i = 0, n = 0; i < plan->count; i++) {
+        const struct extent *extent = &plan->extents[i];
+        for (loff_t off = 0; off < extent->length; off += chunk_size, n++) {
+            chunks[n].cc = &cc;
+            chunks[n].offset = extent->offset + off;
+            chunks[n].length = extent->length - off < chunk_size
+                               ? extent->length - off : chunk_size;
         }
+    }
 
-        ret = copy_range(srcfd, tgtfd, nextoffs - srcoffs);
-        if (ret < 0) {
-            return -1;
+    cc.outstanding = nchunks;
+    for (; submitted < nchunks; submitted++) {
+        if (pool_submit(opts->pool, copy_chunk, &chunks[submitted]) < 0) {
+            int expected = 0;
+            __atomic_compare_exchange_n(&cc.error, &expected, ENOMEM, false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+            break;
         }
+    }
+    /* Chunks that couldn't be queued are finished as far as waiting goes */
+    for (size_t i = submitted; i < nchunks; i++)
+        pool_done(opts->pool, &cc.outstanding);
+    pool_wait_for(opts->pool, &cc.outstanding);
+    copy_syscalls += cc.syscalls;
+
+    if (cc.error != 0) {
+        errno = cc.error;
+        goto cleanup;
+    }
+    plan->size = cc.eof;
+    ret = cc.copied;
+
+cleanup:
+    free(chunks);
+    return ret;
+}
+
+/* Whether the data in plan is worth splitting between workers. */
+static bool plan_chunkable(const struct extent_plan *plan,
+                           const struct copy_opts *opts) {
+    loff_t data = 0;
+
+    if (opts->pool == NULL || opts->chunk_size == 0)
+        return false;
+    for (size_t i = 0; i < plan->count; i++)
+        data += plan->extents[i].length;
+    return data > opts->chunk_size;
+}
+
+/* Copy the extents in plan to delta further on in tgtfd,
+   split between the workers if it's worth it.
+   plan->size is lowered if the source is found to be truncated. */
+static ssize_t copy_plan(int srcfd, int tgtfd, loff_t delta,
+                         struct extent_plan *plan,
+                         const struct copy_opts *opts,
+                         struct pair_caps *caps) {
+    size_t copied = 0;
+    ssize_t ret;
+
+    if (plan_chunkable(plan, opts))
+        return chunked_copy(srcfd, tgtfd, delta, plan, opts, caps);
+
+    for (size_t i = 0; i < plan->count; i++) {
+        loff_t srcoff = plan->extents[i].offset;
+        loff_t tgtoff = srcoff + delta;
+
+        ret = copy_range(srcfd, &srcoff, tgtfd, &tgtoff,
+                         plan->extents[i].length, opts, caps);
+        if (ret < 0)
+            return ret;
         copied += ret;
-        srcoffs = nextoffs;
-
-        nextoffs = TEMP_FAILURE_RETRY(lseek(srcfd, srcoffs, SEEK_DATA));
-        if (nextoffs == (off_t)-1) {
-            if (errno == ENXIO) {
-                /* NXIO means EOF, there is no data to copy,
-                   but we may need to make a hole to the end of the file */
-                goto end_hole;
-            }
-            perror("Find end of hole");
-            /* Error seeking, must not support sparse seek */
-            return -1;
+        if (ret < plan->extents[i].length) {
+            /* Truncated since planning, so this is the new EOF */
+            if (confirm_eof(srcfd, srcoff) < 0)
+                return -1;
+            plan->size = srcoff;
+            break;
         }
-hole:
-        /* Is a hole, extend the file to the offset */
-        ret = TEMP_FAILURE_RETRY(ftruncate(tgtfd, nextoffs));
-        if (ret < 0) {
-            perror("Truncate file to add hole");
-            return -1;
+    }
+    return copied;
+}
+
+/* Copy plan a window of checkpoint->interval bytes of the source at a time,
+   calling checkpoint->fn with the end of each window in the target. */
+static ssize_t copy_windows(int srcfd, int tgtfd, loff_t delta,
+                            struct extent_plan *plan,
+                            const struct copy_opts *opts,
+                            struct pair_caps *caps,
+                            const struct copy_checkpoint *checkpoint) {
+    struct extent_plan window = { .extents = NULL, };
+    size_t first = 0;
+    size_t copied = 0;
+    ssize_t ret = -1;
+
+    window.extents = calloc(plan->count + 1, sizeof *window.extents);
+    if (window.extents == NULL)
+        return ret;
+
+    for (loff_t start = plan->start, end; start < plan->size; start = end) {
+        end = plan->size - start > checkpoint->interval
+              ? start + checkpoint->interval : plan->size;
+
+        /* The parts of the plan's extents within the window */
+        window.count = 0;
+        window.start = start;
+        window.size = end;
+        while (first < plan->count
+               && plan->extents[first].offset
+                  + plan->extents[first].length <= start)
+            first++;
+        for (size_t i = first;
+             i < plan->count && plan->extents[i].offset < end; i++) {
+            const struct extent *extent = &plan->extents[i];
+            loff_t from = extent->offset > start ? extent->offset : start;
+            loff_t to = extent->offset + extent->length < end
+                        ? extent->offset + extent->length : end;
+            window.extents[window.count].offset = from;
+            window.extents[window.count].length = to - from;
+            window.count++;
         }
 
-        /* Move file offset for target to after the newly added hole */
-        nextoffs = TEMP_FAILURE_RETRY(lseek(tgtfd, nextoffs, SEEK_SET));
-        if (nextoffs == (off_t)-1) {
-            /* Something very strange happened,
-               either some race condition changed the file,
-               or the file is truncatable but not seekable
-               or some external memory corruption,
-               since EOVERFLOW can't happen with SEEK_SET */
-            perror("Move to after newly added hole");
-            return -1;
+        ret = copy_plan(srcfd, tgtfd, delta, &window, opts, caps);
+        if (ret < 0)
+            goto cleanup;
+        copied += ret;
+        if (window.size < end) {
+            plan->size = window.size;
+            break;
         }
 
-        srcoffs = nextoffs;
+        ret = checkpoint->fn(checkpoint->arg, end + delta);
+        if (ret < 0)
+            goto cleanup;
     }
+    ret = copied;
+
+cleanup:
+    free(window.extents);
+    return ret;
+}
 
-end_hole:
-    nextoffs = TEMP_FAILURE_RETRY(lseek(srcfd, 0, SEEK_END));
-    if (nextoffs == (off_t)-1) {
-        perror("Seek to end of file");
+/* Allocate the target's blocks for the data in plan before copying it,
+   so the filesystem can lay them out contiguously rather than a write
+   at a time, and a full disk is found before anything is written.
+   Holes are left unallocated, and so are blocks of zeros that are
+   going to be left as holes. Filesystems that can't preallocate
+   are copied to without it. */
+static int preallocate(int tgtfd, loff_t delta,
+                       const struct extent_plan *plan,
+                       const struct copy_opts *opts, struct pair_caps *caps) {
+    if (opts->sparse_always
+        || (caps != NULL
+            && __atomic_load_n(&caps->no_fallocate, __ATOMIC_RELAXED)))
+        return 0;
+
+    for (size_t i = 0; i < plan->count; i++) {
+        int ret = TEMP_FAILURE_RETRY(
+            fallocate(tgtfd, FALLOC_FL_KEEP_SIZE,
+                      plan->extents[i].offset + delta,
+                      plan->extents[i].length));
+        copy_syscalls++;
+        if (ret == 0)
+            continue;
+        if (errno == EOPNOTSUPP || errno == ENOSYS || errno == EINVAL) {
+            if (caps != NULL)
+                __atomic_store_n(&caps->no_fallocate, true, __ATOMIC_RELAXED);
+            return 0;
+        }
+        fsops_fail("Preallocate target file");
         return -1;
     }
-    if (srcoffs != nextoffs) {
-        /* Not already at EOF, need to extend */
-        int ret = TEMP_FAILURE_RETRY(ftruncate(tgtfd, nextoffs));
+    return 0;
+}
+
+/* Copy only the data extents of srcfd from its file position,
+   recreating the holes between them in tgtfd, which tgtst describes. */
+static ssize_t sparse_copy_contents(int srcfd, int tgtfd,
+                                    const struct stat *tgtst,
+                                    const struct copy_opts *opts,
+                                    struct pair_caps *caps,
+                                    const struct copy_checkpoint *checkpoint) {
+    struct extent_plan plan;
+    loff_t tgtsize = tgtst->st_size;
+    loff_t srcstart, tgtstart, tgtend, planned_end;
+    size_t copied = 0;
+    ssize_t ret = -1;
+
+    srcstart = TEMP_FAILURE_RETRY(STATS_SYSCALL(lseek(srcfd, 0, SEEK_CUR)));
+    tgtstart = TEMP_FAILURE_RETRY(STATS_SYSCALL(lseek(tgtfd, 0, SEEK_CUR)));
+    if (srcstart == (off_t)-1 || tgtstart == (off_t)-1) {
+        /* Can't seek file, so it can't have holes */
+        if (errno == ESPIPE)
+            errno = EINVAL;
+        return -1;
+    }
+
+    if (extent_plan_build(srcfd, srcstart, &plan) < 0)
+        return -1;
+
+    ret = preallocate(tgtfd, tgtstart - srcstart, &plan, opts, caps);
+    if (ret < 0)
+        goto cleanup;
+
+    /* Extend the target over any hole at the end,
+       and before copying so chunk writers don't each grow the file */
+    planned_end = tgtend = tgtstart + (plan.size - srcstart);
+    if (tgtsize < tgtend) {
+        ret = TEMP_FAILURE_RETRY(STATS_SYSCALL(ftruncate(tgtfd, tgtend)));
         if (ret < 0) {
-            perror("Truncate to add hole at end of file");
-            return -1;
+            fsops_fail("Truncate to add hole at end of file");
+            goto cleanup;
         }
     }
-    return copied;
 
-end_data:
-    {
-        ssize_t ret;
-        ret = naive_contents_copy(srcfd, tgtfd);
-        if (ret < 0)
-            return ret;
-        copied += ret;
+    if (checkpoint != NULL)
+        ret = copy_windows(srcfd, tgtfd, tgtstart - srcstart, &plan, opts,
+                           caps, checkpoint);
+    else
+        ret = copy_plan(srcfd, tgtfd, tgtstart - srcstart, &plan, opts, caps);
+    if (ret < 0)
+        goto cleanup;
+    copied = ret;
+
+    tgtend = tgtstart + (plan.size - srcstart);
+    if (tgtend < planned_end && tgtsize < planned_end) {
+        /* The source shrank, so take back what the target was extended by */
+        ret = TEMP_FAILURE_RETRY(STATS_SYSCALL(
+            ftruncate(tgtfd, tgtsize > tgtend ? tgtsize : tgtend)));
+        if (ret < 0) {
+            fsops_fail("Truncate target to copied data");
+            goto cleanup;
+        }
     }
-    return copied;
+
+    if (TEMP_FAILURE_RETRY(STATS_SYSCALL(lseek(srcfd, plan.size, SEEK_SET)))
+            == (off_t)-1
+        || TEMP_FAILURE_RETRY(STATS_SYSCALL(lseek(tgtfd, tgtend, SEEK_SET)))
+            == (off_t)-1) {
+        fsops_fail("Move past copied data");
+        ret = -1;
+        goto cleanup;
+    }
+    ret = copied;
+
+cleanup:
+    extent_plan_free(&plan);
+    return ret;
 }
 
-static int btrfs_clone_contents(int srcfd, int tgtfd) {
-        struct statfs stfs;
-        struct stat st;
-        int ret;
+/* Whether a clone failure means the filesystems can never share extents,
+   rather than something about these files or offsets. */
+static bool clone_unsupported(int err) {
+    return err == EOPNOTSUPP || err == ENOTTY || err == ENOSYS || err == EXDEV;
+}
 
-        /* Behaviour is undefined unless called on a btrfs file,
-           so ensure we're calling on the right file first. */
-        ret = fstatfs(tgtfd, &stfs);
-        if (ret < 0)
-                return ret;
-        if (stfs.f_type != BTRFS_SUPER_MAGIC) {
-                errno = EINVAL;
-                return -1;
-        }
+/* Clone each data extent of srcfd from srcoff onwards into tgtfd at tgtoff,
+   leaving holes as holes. */
+static int clone_extents(int srcfd, loff_t srcoff, int tgtfd, loff_t tgtoff,
+                         off_t size) {
+    loff_t data = srcoff;
 
-        ret = fstat(tgtfd, &st);
-        if (ret < 0)
-                return ret;
-        if (!S_ISREG(st.st_mode)) {
-                errno = EINVAL;
-                return -1;
+    while (data < size) {
+        struct file_clone_range fcr;
+        off_t hole;
+
+        data = TEMP_FAILURE_RETRY(lseek(srcfd, data, SEEK_DATA));
+        if (data == (off_t)-1) {
+            if (errno == ENXIO)
+                break;
+            /* Can't find extents, clone everything to EOF in one go */
+            data = srcoff;
+            hole = size;
+        } else {
+            hole = TEMP_FAILURE_RETRY(lseek(srcfd, data, SEEK_HOLE));
+            if (hole == (off_t)-1)
+                hole = size;
         }
 
-        return ioctl(tgtfd, BTRFS_IOC_CLONE, srcfd);
+        fcr.src_fd = srcfd;
+        fcr.src_offset = data;
+        /* 0 clones to EOF, which needn't be block aligned */
+        fcr.src_length = hole >= size ? 0 : hole - data;
+        fcr.dest_offset = tgtoff + (data - srcoff);
+        copy_syscalls++;
+        if (ioctl(tgtfd, FICLONERANGE, &fcr) < 0)
+            return -1;
+
+        data = hole;
+    }
+
+    /* Any hole at the end isn't made by cloning extents */
+    return TEMP_FAILURE_RETRY(ftruncate(tgtfd, tgtoff + (size - srcoff)));
 }
 
-int copy_contents(int srcfd, int tgtfd) {
-    int ret = -1;
-    ret = btrfs_clone_contents(srcfd, tgtfd);
-    if (ret >= 0)
+/* Share the source's extents with the target instead of copying data.
+   The whole file is cloned when both files are at their start,
+   otherwise, or if that's refused, each remaining data extent is cloned.
+   Returns the number of bytes cloned, with both offsets moved past them,
+   or -1 with errno EINVAL if cloning isn't possible. */
+static ssize_t clone_contents(int srcfd, int tgtfd, const struct stat *srcst,
+                              const struct stat *tgtst,
+                              struct pair_caps *caps) {
+    loff_t srcoff, tgtoff;
+    int ret;
+
+    if (!S_ISREG(srcst->st_mode) || !S_ISREG(tgtst->st_mode)
+        || (caps != NULL
+            && __atomic_load_n(&caps->no_clone, __ATOMIC_RELAXED))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    srcoff = TEMP_FAILURE_RETRY(lseek(srcfd, 0, SEEK_CUR));
+    tgtoff = TEMP_FAILURE_RETRY(lseek(tgtfd, 0, SEEK_CUR));
+    if (srcoff == (off_t)-1 || tgtoff == (off_t)-1) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (srcoff >= srcst->st_size)
+        return 0;
+
+    ret = -1;
+    if (srcoff == 0 && tgtoff == 0) {
+        copy_syscalls++;
+        ret = ioctl(tgtfd, FICLONE, srcfd);
+    }
+    if (ret < 0 && (srcoff != 0 || tgtoff != 0 || !clone_unsupported(errno)))
+        ret = clone_extents(srcfd, srcoff, tgtfd, tgtoff, srcst->st_size);
+    if (ret < 0) {
+        if (clone_unsupported(errno) && caps != NULL)
+            __atomic_store_n(&caps->no_clone, true, __ATOMIC_RELAXED);
+        /* Finding extents moved the offset the copy fallbacks start from */
+        if (TEMP_FAILURE_RETRY(lseek(srcfd, srcoff, SEEK_SET)) == (off_t)-1)
+            return -1;
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (TEMP_FAILURE_RETRY(lseek(srcfd, srcst->st_size, SEEK_SET)) == (off_t)-1
+        || TEMP_FAILURE_RETRY(lseek(tgtfd, tgtoff + (srcst->st_size - srcoff),
+                                    SEEK_SET)) == (off_t)-1) {
+        fsops_fail("Move past cloned data");
+        return -1;
+    }
+    stats_backend(COPY_BACKEND_CLONE, srcst->st_size - srcoff);
+    progress_backend(COPY_BACKEND_CLONE);
+    progress_add(srcst->st_size - srcoff);
+    return srcst->st_size - srcoff;
+}
+
+static ssize_t contents_copy(int srcfd, int tgtfd,
+                             const struct copy_opts *opts,
+                             const struct copy_checkpoint *checkpoint) {
+    struct file_meta srcmeta, tgtmeta;
+    const struct stat *srcst, *tgtst;
+    struct pair_caps *caps;
+    ssize_t ret = -1;
+
+    if (opts == NULL)
+        opts = &copy_opts_default;
+
+    if ((opts->source == NULL && file_meta_fd(srcfd, &srcmeta) < 0)
+        || (opts->target == NULL && file_meta_fd(tgtfd, &tgtmeta) < 0)) {
+        fsops_fail("Stat files to copy");
+        return -1;
+    }
+    srcst = opts->source != NULL ? &opts->source->st : &srcmeta.st;
+    tgtst = opts->target != NULL ? &opts->target->st : &tgtmeta.st;
+    caps = pair_caps_get(srcst->st_dev, tgtst->st_dev);
+
+    ret = clone_contents(srcfd, tgtfd, srcst, tgtst, caps);
+    if (ret >= 0) {
+        if (ret > 0 && opts->digest != NULL)
+            digest_skip(opts->digest);
         return ret;
+    }
 
     if (ret < 0 && errno != EINVAL) {
-        /* Some error that wasn't from a btrfs clone,
+        /* Some error that wasn't from a clone,
 	   so we can't fall back to something that would work */
-        perror("Copy file");
+        fsops_fail("Copy file");
         return -1;
     }
 
-    ret = sparse_copy_contents(srcfd, tgtfd);
+    ret = sparse_copy_contents(srcfd, tgtfd, tgtst, opts, caps, checkpoint);
     if (ret >= 0)
         return ret;
 
     if (ret < 0 && errno != EINVAL) {
         /* Some error that wasn't from a sparse copy,
 	   so we can't fall back to something that would work */
-        perror("Copy file");
+        fsops_fail("Copy file");
         return -1;
     }
 
-    return naive_contents_copy(srcfd, tgtfd);
+    return naive_contents_copy(srcfd, tgtfd, opts, caps);
+}
+
+ssize_t copy_contents(int srcfd, int tgtfd, const struct copy_opts *opts) {
+    return contents_copy(srcfd, tgtfd, opts, NULL);
+}
+
+ssize_t copy_contents_checkpointed(int srcfd, int tgtfd,
+                                   const struct copy_checkpoint *checkpoint,
+                                   const struct copy_opts *opts) {
+    return contents_copy(srcfd, tgtfd, opts, checkpoint);
 }
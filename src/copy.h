@@ -15,4 +15,71 @@
 /* ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF  */
 /* OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.           */
 
-int copy_contents(int srcfd, int tgtfd);
+#pragma once
+
+#include <stdbool.h>         /* bool */
+#include <sys/types.h>       /* loff_t, size_t, ssize_t */
+
+struct pool;
+struct digest;
+struct file_meta;
+
+/* Tunables for one copy, passed down to every backend it uses. */
+struct copy_opts {
+    unsigned uring_depth;        /* io_uring buffers in flight, 0 disables */
+    struct pool *pool;           /* workers to copy chunks of large files */
+    size_t chunk_size;           /* bytes per chunk, 0 copies in one stream */
+    bool sparse_always;          /* make holes where the source has zeros */
+    bool direct;                 /* bypass the page cache with O_DIRECT */
+    struct digest *digest;       /* hashes the data copied through memory,
+                                    and is marked partial for the rest */
+    const struct file_meta *source;  /* what's known of the files already, */
+    const struct file_meta *target;  /* or NULL to stat them */
+};
+
+extern const struct copy_opts copy_opts_default;
+
+/* System calls made by the copy backends on the calling thread. */
+extern __thread unsigned long long copy_syscalls;
+
+/* Copy from the file positions of srcfd to tgtfd until the end of srcfd,
+   with the defaults if opts is NULL. Returns the number of bytes copied. */
+ssize_t copy_contents(int srcfd, int tgtfd, const struct copy_opts *opts);
+
+/* Called as a checkpointed copy goes, once everything before offset
+   in the target has been copied. Returns 0, or -1 to stop the copy. */
+typedef int copy_checkpoint_fn(void *arg, loff_t offset);
+
+struct copy_checkpoint {
+    loff_t interval;             /* bytes of source between checkpoints */
+    copy_checkpoint_fn *fn;
+    void *arg;
+};
+
+/* As copy_contents, calling checkpoint->fn every interval bytes
+   while data extents are copied. Clones and copies of files
+   without extents finish without reaching any checkpoints. */
+ssize_t copy_contents_checkpointed(int srcfd, int tgtfd,
+                                   const struct copy_checkpoint *checkpoint,
+                                   const struct copy_opts *opts);
+
+/* The ways copy_contents can move data, for driving one directly. */
+enum copy_backend {
+    COPY_BACKEND_AUTO,           /* each in turn until one works */
+    COPY_BACKEND_CFR,            /* copy_file_range */
+    COPY_BACKEND_URING,          /* io_uring reads and writes */
+    COPY_BACKEND_SENDFILE,
+    COPY_BACKEND_SPLICE,
+    COPY_BACKEND_NAIVE,          /* read and write */
+    COPY_BACKEND_CLONE,          /* FICLONERANGE */
+    COPY_BACKEND_DIRECT,         /* O_DIRECT reads and writes */
+    COPY_BACKEND_COUNT,
+};
+
+extern const char *const copy_backend_names[COPY_BACKEND_COUNT];
+
+/* Copy up to range bytes with one backend, as copy_file_range would.
+   Nothing falls back to another backend if it isn't supported. */
+ssize_t copy_backend_range(enum copy_backend backend, int srcfd,
+                           loff_t *srcoff, int tgtfd, loff_t *tgtoff,
+                           size_t range);
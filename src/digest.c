@@ -0,0 +1,221 @@
+
+/* ISC License                                                              */
+/*                                                                          */
+/* Copyright (c) 2016, Richard Maw                                          */
+/*                                                                          */
+/* Permission to use, copy, modify, and/or distribute this software for any */
+/* purpose with or without fee is hereby granted, provided that the above   */
+/* copyright notice and this permission notice appear in all copies.        */
+/*                                                                          */
+/* THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES */
+/* WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF         */
+/* MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR  */
+/* ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES   */
+/* WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN    */
+/* ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF  */
+/* OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.           */
+
+#include <stdbool.h>         /* bool, true, false */
+#include <stdint.h>          /* uint32_t, uint64_t */
+#include <stdio.h>           /* snprintf */
+#include <stdlib.h>          /* NULL, posix_memalign, free */
+#include <string.h>          /* memcpy */
+#include <errno.h>           /* errno, EINVAL */
+#include <fcntl.h>           /* open, O_* */
+#include <unistd.h>          /* pread */
+#include <pthread.h>         /* pthread_once */
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>       /* _mm_crc32_* */
+#endif
+
+#include "digest.h"
+#include "extents.h"         /* extent_plan_* */
+#include "stats.h"           /* STATS_SYSCALL */
+
+/* CRC32C's polynomial, bit reversed as the CRC32 instruction uses it */
+#define POLY 0x82f63b78
+#define READ_SIZE (1024 * 1024)
+#define DIRECT_ALIGN 4096
+
+/* The CRCs are kept without the usual inversions before and after,
+   so a run of zeros leaves a CRC of zero unchanged. */
+typedef uint32_t crc_fn(uint32_t crc, const unsigned char *buf, size_t len);
+
+static uint32_t crc_table[256];
+/* x^(2^k) modulo POLY, for shifting a CRC past 2^(k-3) zero bytes */
+static uint32_t x2n_table[67];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+/* a times b modulo POLY */
+static uint32_t multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = (uint32_t)1 << 31;
+    uint32_t p = 0;
+
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ POLY : b >> 1;
+    }
+    return p;
+}
+
+static void make_tables(void) {
+    uint32_t p = (uint32_t)1 << 30;      /* x^1 */
+
+    for (unsigned i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+        crc_table[i] = crc;
+    }
+    for (unsigned k = 0; k < sizeof x2n_table / sizeof *x2n_table; k++) {
+        x2n_table[k] = p;
+        p = multmodp(p, p);
+    }
+}
+
+/* The CRC of crc followed by len zero bytes. */
+static uint32_t crc_shift(uint32_t crc, uint64_t len) {
+    uint32_t p = (uint32_t)1 << 31;      /* x^0 */
+
+    for (unsigned k = 3; len != 0; len >>= 1, k++) {
+        if (len & 1)
+            p = multmodp(x2n_table[k], p);
+    }
+    return multmodp(p, crc);
+}
+
+static uint32_t table_crc(uint32_t crc, const unsigned char *buf, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        crc = crc_table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t sse42_crc(uint32_t crc, const unsigned char *buf, size_t len) {
+    uint64_t crc64 = crc;
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, buf + i, sizeof word);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = crc64;
+    for (; i < len; i++)
+        crc = _mm_crc32_u8(crc, buf[i]);
+    return crc;
+}
+#endif
+
+/* Chosen on first use, racing threads all choose the same one */
+static crc_fn *crc;
+
+static crc_fn *choose_crc(void) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        return sse42_crc;
+#endif
+    return table_crc;
+}
+
+void digest_init(struct digest *digest, loff_t size) {
+    pthread_once(&tables_once, make_tables);
+    digest->size = size;
+    digest->crc = 0;
+    digest->partial = false;
+}
+
+void digest_add(struct digest *digest, loff_t offset, const void *buf,
+                size_t len) {
+    crc_fn *fn = __atomic_load_n(&crc, __ATOMIC_RELAXED);
+    uint32_t part;
+
+    if (offset < 0 || offset > digest->size || len > digest->size - offset) {
+        /* Past the size it was started with, so it can't be placed */
+        digest_skip(digest);
+        return;
+    }
+    if (fn == NULL) {
+        fn = choose_crc();
+        __atomic_store_n(&crc, fn, __ATOMIC_RELAXED);
+    }
+    part = fn(0, buf, len);
+    part = crc_shift(part, digest->size - offset - len);
+    __atomic_fetch_xor(&digest->crc, part, __ATOMIC_RELAXED);
+}
+
+void digest_skip(struct digest *digest) {
+    __atomic_store_n(&digest->partial, true, __ATOMIC_RELAXED);
+}
+
+/* Read and add the len bytes of *fd at offset through buf,
+   switching *fd to bufferedfd if it can't be read directly. */
+static int digest_extent(struct digest *digest, int *fd, int bufferedfd,
+                         char *buf, loff_t offset, loff_t len) {
+    while (len > 0) {
+        /* Direct reads have to be whole blocks, and stop short at EOF */
+        size_t want = len < READ_SIZE ? len : READ_SIZE;
+        size_t aligned = (want + DIRECT_ALIGN - 1) / DIRECT_ALIGN
+                         * DIRECT_ALIGN;
+        ssize_t got = TEMP_FAILURE_RETRY(STATS_SYSCALL(pread(*fd, buf, aligned,
+                                                             offset)));
+        if (got < 0 && errno == EINVAL && *fd != bufferedfd) {
+            /* Not aligned as the device needs, so read through the cache */
+            *fd = bufferedfd;
+            continue;
+        }
+        if (got < 0)
+            return -1;
+        if (got == 0)
+            break;
+        if (got > want)
+            got = want;
+        digest_add(digest, offset, buf, got);
+        offset += got;
+        len -= got;
+    }
+    return 0;
+}
+
+int digest_open_direct(int fd) {
+    char path[sizeof "/proc/self/fd/" + 3 * sizeof(int)];
+
+    /* Not set on fd itself, since that would change how it's written */
+    snprintf(path, sizeof path, "/proc/self/fd/%d", fd);
+    return STATS_SYSCALL(open(path, O_RDONLY|O_DIRECT|O_CLOEXEC));
+}
+
+int digest_file(struct digest *digest, int fd, int directfd) {
+    struct extent_plan plan = { 0 };
+    char *buf = NULL;
+    int readfd = directfd < 0 ? fd : directfd;
+    int ret = -1;
+
+    errno = posix_memalign((void **)&buf, DIRECT_ALIGN, READ_SIZE);
+    if (errno != 0) {
+        buf = NULL;
+        goto cleanup;
+    }
+
+    ret = extent_plan_build(fd, 0, &plan);
+    if (ret < 0)
+        goto cleanup;
+    for (size_t i = 0; i < plan.count; i++) {
+        ret = digest_extent(digest, &readfd, fd, buf, plan.extents[i].offset,
+                            plan.extents[i].length);
+        if (ret < 0)
+            goto cleanup;
+    }
+
+cleanup:
+    extent_plan_free(&plan);
+    free(buf);
+    return ret;
+}
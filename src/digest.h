@@ -0,0 +1,50 @@
+
+/* ISC License                                                              */
+/*                                                                          */
+/* Copyright (c) 2016, Richard Maw                                          */
+/*                                                                          */
+/* Permission to use, copy, modify, and/or distribute this software for any */
+/* purpose with or without fee is hereby granted, provided that the above   */
+/* copyright notice and this permission notice appear in all copies.        */
+/*                                                                          */
+/* THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES */
+/* WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF         */
+/* MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR  */
+/* ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES   */
+/* WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN    */
+/* ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF  */
+/* OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.           */
+
+#pragma once
+
+#include <stdbool.h>         /* bool */
+#include <stdint.h>          /* uint32_t */
+#include <sys/types.h>       /* loff_t, size_t */
+
+/* A CRC32C of a file's data built from parts added in any order,
+   so chunks copied by different workers can each add what they saw.
+   Each part's CRC is shifted past the bytes after it in the file,
+   which makes holes and zeros free and parts independent of each other. */
+struct digest {
+    loff_t size;                 /* of the file, set before adding */
+    uint32_t crc;
+    bool partial;                /* some data wasn't added to it */
+};
+
+void digest_init(struct digest *digest, loff_t size);
+
+/* Add the len bytes of the file at offset, which may be called
+   from several threads at once for different parts. */
+void digest_add(struct digest *digest, loff_t offset, const void *buf,
+                size_t len);
+
+/* Note that some of the file's data won't be added. */
+void digest_skip(struct digest *digest);
+
+/* Open fd again to read with O_DIRECT, so what's read is what reached
+   the device rather than what's in the page cache, or return -1. */
+int digest_open_direct(int fd);
+
+/* Add all the data of fd, read through directfd unless it's -1,
+   or through fd if directfd can't be read from. */
+int digest_file(struct digest *digest, int fd, int directfd);
@@ -0,0 +1,175 @@
+
+/* ISC License                                                              */
+/*                                                                          */
+/* Copyright (c) 2016, Richard Maw                                          */
+/*                                                                          */
+/* Permission to use, copy, modify, and/or distribute this software for any */
+/* purpose with or without fee is hereby granted, provided that the above   */
+/* copyright notice and this permission notice appear in all copies.        */
+/*                                                                          */
+/* THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES */
+/* WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF         */
+/* MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR  */
+/* ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES   */
+/* WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN    */
+/* ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF  */
+/* OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.           */
+
+#include <errno.h>           /* errno, E* */
+#include <stdlib.h>          /* NULL, free, realloc */
+#include <string.h>          /* memset */
+#include <unistd.h>          /* lseek, SEEK_* */
+#include <sys/ioctl.h>       /* ioctl */
+#include <sys/stat.h>        /* fstat, struct stat, S_ISREG */
+#include <linux/fs.h>        /* FS_IOC_FIEMAP */
+#include <linux/fiemap.h>    /* struct fiemap, FIEMAP_* */
+
+#include "extents.h"
+#include "missing.h"         /* SEEK_DATA, SEEK_HOLE */
+#include "stats.h"           /* STATS_SYSCALL */
+
+/* Extents fetched per FS_IOC_FIEMAP call */
+#define FIEMAP_BATCH 256
+
+static int plan_add(struct extent_plan *plan, loff_t offset, loff_t end) {
+    struct extent *last;
+
+    if (offset < plan->start)
+        offset = plan->start;
+    if (end > plan->size)
+        end = plan->size;
+    if (offset >= end)
+        return 0;
+
+    last = plan->count ? &plan->extents[plan->count - 1] : NULL;
+    if (last != NULL && last->offset + last->length >= offset) {
+        if (end > last->offset + last->length)
+            last->length = end - last->offset;
+        return 0;
+    }
+
+    if (plan->count == plan->alloc) {
+        size_t new_alloc = plan->alloc ? plan->alloc * 2 : 16;
+        struct extent *new_extents = realloc(plan->extents,
+                                             new_alloc * sizeof *new_extents);
+        if (new_extents == NULL)
+            return -1;
+        plan->extents = new_extents;
+        plan->alloc = new_alloc;
+    }
+    plan->extents[plan->count].offset = offset;
+    plan->extents[plan->count].length = end - offset;
+    plan->count++;
+    return 0;
+}
+
+static int plan_fiemap(int fd, struct extent_plan *plan) {
+    union {
+        struct fiemap fm;
+        char buf[sizeof(struct fiemap)
+                 + FIEMAP_BATCH * sizeof(struct fiemap_extent)];
+    } u;
+    loff_t next = plan->start;
+
+    while (next < plan->size) {
+        struct fiemap_extent *ext = NULL;
+
+        memset(&u.fm, 0, sizeof u.fm);
+        u.fm.fm_start = next;
+        u.fm.fm_length = FIEMAP_MAX_OFFSET - next;
+        /* Without a sync, data still in the page cache may be reported
+           as a hole or an unwritten extent and silently dropped. */
+        u.fm.fm_flags = FIEMAP_FLAG_SYNC;
+        u.fm.fm_extent_count = FIEMAP_BATCH;
+        if (STATS_SYSCALL(ioctl(fd, FS_IOC_FIEMAP, &u.fm)) < 0)
+            return -1;
+        if (u.fm.fm_mapped_extents == 0)
+            break;
+
+        for (unsigned i = 0; i < u.fm.fm_mapped_extents; i++) {
+            ext = &u.fm.fm_extents[i];
+            /* Preallocated but never written reads as zeroes */
+            if (ext->fe_flags & FIEMAP_EXTENT_UNWRITTEN)
+                continue;
+            if (plan_add(plan, ext->fe_logical,
+                         ext->fe_logical + ext->fe_length) < 0)
+                return -1;
+        }
+        if (ext->fe_flags & FIEMAP_EXTENT_LAST)
+            break;
+        next = ext->fe_logical + ext->fe_length;
+    }
+    return 0;
+}
+
+static int plan_seek(int fd, struct extent_plan *plan) {
+    off_t orig;
+    off_t data = plan->start;
+    int ret = 0;
+
+    orig = TEMP_FAILURE_RETRY(STATS_SYSCALL(lseek(fd, 0, SEEK_CUR)));
+    if (orig == (off_t)-1)
+        return -1;
+
+    while (data < plan->size) {
+        off_t hole;
+
+        data = TEMP_FAILURE_RETRY(STATS_SYSCALL(lseek(fd, data, SEEK_DATA)));
+        if (data == (off_t)-1) {
+            /* ENXIO means there's no more data before EOF */
+            if (errno != ENXIO)
+                ret = -1;
+            break;
+        }
+        hole = TEMP_FAILURE_RETRY(STATS_SYSCALL(lseek(fd, data, SEEK_HOLE)));
+        if (hole == (off_t)-1) {
+            ret = -1;
+            break;
+        }
+
+        ret = plan_add(plan, data, hole);
+        if (ret < 0)
+            break;
+        data = hole;
+    }
+
+    if (TEMP_FAILURE_RETRY(STATS_SYSCALL(lseek(fd, orig, SEEK_SET)))
+        == (off_t)-1)
+        ret = -1;
+    return ret;
+}
+
+int extent_plan_build(int fd, loff_t start, struct extent_plan *plan) {
+    struct stat st;
+
+    memset(plan, 0, sizeof *plan);
+
+    if (STATS_SYSCALL(fstat(fd, &st)) < 0)
+        return -1;
+    if (!S_ISREG(st.st_mode)) {
+        errno = EINVAL;
+        return -1;
+    }
+    plan->start = start;
+    plan->size = st.st_size;
+
+    if (plan_fiemap(fd, plan) == 0)
+        return 0;
+
+    plan->count = 0;
+    if (plan_seek(fd, plan) == 0)
+        return 0;
+
+    /* No way to find holes, so copy everything */
+    plan->count = 0;
+    if (plan_add(plan, start, plan->size) < 0) {
+        extent_plan_free(plan);
+        return -1;
+    }
+    return 0;
+}
+
+void extent_plan_free(struct extent_plan *plan) {
+    free(plan->extents);
+    memset(plan, 0, sizeof *plan);
+}
@@ -0,0 +1,44 @@
+
+/* ISC License                                                              */
+/*                                                                          */
+/* Copyright (c) 2016, Richard Maw                                          */
+/*                                                                          */
+/* Permission to use, copy, modify, and/or distribute this software for any */
+/* purpose with or without fee is hereby granted, provided that the above   */
+/* copyright notice and this permission notice appear in all copies.        */
+/*                                                                          */
+/* THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES */
+/* WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF         */
+/* MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR  */
+/* ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES   */
+/* WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN    */
+/* ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF  */
+/* OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.           */
+
+#include <sys/types.h>       /* loff_t, size_t */
+
+/* A range of a file that holds data. */
+struct extent {
+    loff_t offset;
+    loff_t length;
+};
+
+/* The data in a file from start to size, in order,
+   with the gaps between extents being holes. */
+struct extent_plan {
+    struct extent *extents;
+    size_t count;
+    size_t alloc;
+    loff_t start;
+    loff_t size;
+};
+
+/* Fill plan with the data extents of fd from start onwards.
+   Extents are read in batches with FS_IOC_FIEMAP,
+   falling back to SEEK_DATA/SEEK_HOLE, then to treating it all as data.
+   Adjacent extents are merged and unwritten extents are left as holes.
+   The file offset of fd is not changed.
+   Returns 0, or -1 with errno EINVAL if fd isn't a regular file. */
+int extent_plan_build(int fd, loff_t start, struct extent_plan *plan);
+
+void extent_plan_free(struct extent_plan *plan);
@@ -0,0 +1,109 @@
+
+/* ISC License                                                              */
+/*                                                                          */
+/* Copyright (c) 2016, Richard Maw                                          */
+/*                                                                          */
+/* Permission to use, copy, modify, and/or distribute this software for any */
+/* purpose with or without fee is hereby granted, provided that the above   */
+/* copyright notice and this permission notice appear in all copies.        */
+/*                                                                          */
+/* THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES */
+/* WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF         */
+/* MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR  */
+/* ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES   */
+/* WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN    */
+/* ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF  */
+/* OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.           */
+
+#include <errno.h>           /* errno */
+#include <stddef.h>          /* NULL */
+#include <sys/stat.h>        /* fstat, struct stat, S_ISREG */
+#include <pthread.h>         /* pthread_mutex_* */
+
+#include "fsops.h"
+#include "internal.h"
+#include "copy.h"            /* copy_contents, copy_opts_default */
+#include "pool.h"            /* pool_new */
+
+static __thread struct fsops_error last_error;
+
+const struct fsops_error *fsops_last_error(void) {
+    return &last_error;
+}
+
+void fsops_fail(const char *what) {
+    if (last_error.what != NULL)
+        return;
+    last_error.err = errno;
+    last_error.what = what;
+}
+
+void fsops_clear_error(void) {
+    last_error.err = 0;
+    last_error.what = NULL;
+}
+
+/* Started on first use and kept for the rest of the process,
+   so a batch of many moves doesn't start new threads for each. */
+static struct pool *shared_pool;
+static pthread_mutex_t shared_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct pool *fsops_pool(unsigned jobs) {
+    struct pool *pool = __atomic_load_n(&shared_pool, __ATOMIC_ACQUIRE);
+    if (pool != NULL)
+        return pool;
+
+    pthread_mutex_lock(&shared_pool_lock);
+    if (shared_pool == NULL)
+        __atomic_store_n(&shared_pool, pool_new(jobs), __ATOMIC_RELEASE);
+    pool = shared_pool;
+    pthread_mutex_unlock(&shared_pool_lock);
+    return pool;
+}
+
+void fsops_opts_init(struct fsops_opts *opts) {
+    *opts = (struct fsops_opts){
+        .clobber = CLOBBER_PERMITTED,
+        .setgid = SETGID_AUTO,
+        .required_flags = 0,
+        .jobs = 0,
+        .uring_depth = copy_opts_default.uring_depth,
+        .chunk_size = copy_opts_default.chunk_size,
+        .sparse_always = copy_opts_default.sparse_always,
+        .direct = copy_opts_default.direct,
+        .resume = false,
+        .verify = false,
+        .durability = DURABILITY_NONE,
+    };
+}
+
+int64_t fsops_copy_contents(int srcfd, int tgtfd,
+                            const struct fsops_opts *opts) {
+    struct fsops_opts defaults;
+    struct copy_opts copy;
+    struct stat st;
+    ssize_t ret;
+
+    fsops_clear_error();
+    if (opts == NULL) {
+        fsops_opts_init(&defaults);
+        opts = &defaults;
+    }
+    copy = (struct copy_opts){
+        .uring_depth = opts->uring_depth,
+        .chunk_size = opts->chunk_size,
+        .sparse_always = opts->sparse_always,
+        .direct = opts->direct,
+    };
+
+    /* Only start the workers for a file worth splitting between them,
+       and copy it in one stream if they can't be started. */
+    if (opts->jobs != 1 && opts->chunk_size != 0 && fstat(srcfd, &st) == 0
+        && S_ISREG(st.st_mode) && (uint64_t)st.st_size > opts->chunk_size)
+        copy.pool = fsops_pool(opts->jobs);
+
+    ret = copy_contents(srcfd, tgtfd, &copy);
+    if (ret < 0)
+        fsops_fail("Copy file");
+    return ret;
+}
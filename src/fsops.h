@@ -0,0 +1,84 @@
+
+/* ISC License                                                              */
+/*                                                                          */
+/* Copyright (c) 2016, Richard Maw                                          */
+/*                                                                          */
+/* Permission to use, copy, modify, and/or distribute this software for any */
+/* purpose with or without fee is hereby granted, provided that the above   */
+/* copyright notice and this permission notice appear in all copies.        */
+/*                                                                          */
+/* THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES */
+/* WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF         */
+/* MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR  */
+/* ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES   */
+/* WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN    */
+/* ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF  */
+/* OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.           */
+
+#pragma once
+
+/* libfsops: moving and copying files with all their metadata.
+   Every call takes its own options, so threads can move files at once,
+   and failures are described by fsops_last_error on the failing thread. */
+
+#include <stdbool.h>         /* bool */
+#include <stdint.h>          /* int64_t, uint64_t */
+
+#include "clobber.h"         /* enum clobber */
+#include "setgid.h"          /* enum setgid */
+#include "durability.h"      /* enum durability */
+
+/* libfsops.so is built with everything else hidden,
+   so only what's declared with this is exported. */
+#define FSOPS_API __attribute__((visibility("default")))
+
+struct fsops_opts {
+    enum clobber clobber;        /* what to do if the target exists */
+    enum setgid setgid;          /* whether to take the target dir's group */
+    int required_flags;          /* FS_*_FL that must be kept, or fail */
+    unsigned jobs;               /* copy workers, 0 for one per CPU,
+                                    shared by every call and started
+                                    with the jobs of the first to copy */
+    unsigned uring_depth;        /* io_uring buffers in flight, 0 disables */
+    uint64_t chunk_size;         /* bytes per parallel chunk, 0 disables */
+    bool sparse_always;          /* make holes where the source has zeros,
+                                    not just where it has holes */
+    bool direct;                 /* copy around the page cache */
+    bool resume;                 /* keep a journal of file copies to
+                                    carry on from if they're interrupted */
+    bool verify;                 /* check copies against their sources
+                                    before committing them */
+    enum durability durability;  /* what's synced before sources go */
+};
+
+/* The failure behind the last fsops call on this thread to fail. */
+struct fsops_error {
+    int err;                     /* errno value */
+    const char *what;            /* what was being done, NULL if nothing */
+};
+
+/* Fill opts with the defaults used when NULL is passed for it. */
+FSOPS_API void fsops_opts_init(struct fsops_opts *opts);
+
+/* Copy from the file positions of srcfd to tgtfd until the end of srcfd,
+   keeping holes and sharing extents where the filesystems allow it.
+   Returns the number of bytes copied, or -1. */
+FSOPS_API int64_t fsops_copy_contents(int srcfd, int tgtfd,
+                                      const struct fsops_opts *opts);
+
+/* Move source to target, renaming if possible,
+   otherwise copying it and its metadata then removing the source.
+   Returns 0, or -1 if any of it failed. */
+FSOPS_API int fsops_move(const char *source, const char *target,
+                         const struct fsops_opts *opts);
+
+/* Finish the moves left for a batch by DURABILITY_BATCH:
+   sync the filesystems their copies are on, then remove their sources.
+   Batches are finished as they fill, and this must be called after
+   the last move for the rest to be. Returns 0, or -1 if any of it failed
+   here or while finishing a batch that filled since the last call,
+   in which case the sources left are the ones not known to be synced
+   or that couldn't be removed. */
+FSOPS_API int fsops_flush(void);
+
+FSOPS_API const struct fsops_error *fsops_last_error(void);
@@ -0,0 +1,34 @@
+
+/* ISC License                                                              */
+/*                                                                          */
+/* Copyright (c) 2016, Richard Maw                                          */
+/*                                                                          */
+/* Permission to use, copy, modify, and/or distribute this software for any */
+/* purpose with or without fee is hereby granted, provided that the above   */
+/* copyright notice and this permission notice appear in all copies.        */
+/*                                                                          */
+/* THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES */
+/* WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF         */
+/* MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR  */
+/* ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES   */
+/* WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN    */
+/* ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF  */
+/* OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.           */
+
+#pragma once
+
+/* Glue between the parts of libfsops that isn't part of its interface. */
+
+#include "pool.h"            /* struct pool */
+
+/* Record errno and what was being done as this thread's last error,
+   unless a failure has already been recorded since it was last cleared,
+   since that is closer to the cause. errno is left as it was. */
+void fsops_fail(const char *what);
+
+/* Forget the recorded failure, at the start of a call or a pool task. */
+void fsops_clear_error(void);
+
+/* The copy workers shared by every call, started on first use
+   with jobs threads. Returns NULL if they couldn't be started. */
+struct pool *fsops_pool(unsigned jobs);
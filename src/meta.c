@@ -0,0 +1,148 @@
+
+/* ISC License                                                              */
+/*                                                                          */
+/* Copyright (c) 2016, Richard Maw                                          */
+/*                                                                          */
+/* Permission to use, copy, modify, and/or distribute this software for any */
+/* purpose with or without fee is hereby granted, provided that the above   */
+/* copyright notice and this permission notice appear in all copies.        */
+/*                                                                          */
+/* THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES */
+/* WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF         */
+/* MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR  */
+/* ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES   */
+/* WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN    */
+/* ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF  */
+/* OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.           */
+
+#include <stdbool.h>         /* bool, true, false */
+#include <errno.h>           /* errno, ENOSYS */
+#include <fcntl.h>           /* AT_* */
+#include <string.h>          /* memset */
+#include <sys/stat.h>        /* statx, fstatat, struct statx, STATX_* */
+#include <sys/vfs.h>         /* fstatfs, struct statfs */
+#include <sys/sysmacros.h>   /* makedev */
+
+#include "meta.h"
+#include "copy.h"            /* copy_syscalls */
+
+/* Everything file_meta has room for */
+#define FILE_META_MASK (STATX_BASIC_STATS|STATX_BTIME|STATX_MNT_ID)
+
+/* Filesystems are only looked up once per device and mount.
+   Mount ids are only given by newer kernels, and are 0 otherwise. */
+#define FS_CACHE_SLOTS 64
+
+enum fs_state {
+    FS_EMPTY,
+    FS_CLAIMED,                  /* being looked up by one thread */
+    FS_READY,
+};
+
+struct fs_entry {
+    dev_t dev;
+    uint64_t mnt_id;
+    unsigned state;              /* enum fs_state */
+    struct fs_meta fs;
+};
+
+static struct fs_entry fs_cache[FS_CACHE_SLOTS];
+/* Returned when the cache is full, until the next lookup on the thread */
+static __thread struct fs_meta fs_uncached;
+static bool no_statx;
+
+static void meta_from_statx(struct file_meta *meta, const struct statx *stx) {
+    struct stat *st = &meta->st;
+
+    memset(meta, 0, sizeof *meta);
+    st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    st->st_ino = stx->stx_ino;
+    st->st_mode = stx->stx_mode;
+    st->st_nlink = stx->stx_nlink;
+    st->st_uid = stx->stx_uid;
+    st->st_gid = stx->stx_gid;
+    st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+    st->st_size = stx->stx_size;
+    st->st_blksize = stx->stx_blksize;
+    st->st_blocks = stx->stx_blocks;
+    st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+
+    meta->mask = stx->stx_mask;
+    meta->btime.tv_sec = stx->stx_btime.tv_sec;
+    meta->btime.tv_nsec = stx->stx_btime.tv_nsec;
+    if (stx->stx_mask & STATX_MNT_ID)
+        meta->mnt_id = stx->stx_mnt_id;
+}
+
+int file_meta_at(int dirfd, const char *path, int flags,
+                 struct file_meta *meta) {
+    struct statx stx;
+    int ret;
+
+    if (!__atomic_load_n(&no_statx, __ATOMIC_RELAXED)) {
+        copy_syscalls++;
+        ret = statx(dirfd, path, flags|AT_STATX_SYNC_AS_STAT, FILE_META_MASK,
+                    &stx);
+        if (ret == 0) {
+            meta_from_statx(meta, &stx);
+            return 0;
+        }
+        if (errno != ENOSYS)
+            return ret;
+        __atomic_store_n(&no_statx, true, __ATOMIC_RELAXED);
+    }
+
+    memset(meta, 0, sizeof *meta);
+    copy_syscalls++;
+    return fstatat(dirfd, path, &meta->st, flags);
+}
+
+int file_meta_fd(int fd, struct file_meta *meta) {
+    return file_meta_at(fd, "", AT_EMPTY_PATH, meta);
+}
+
+struct fs_meta *file_meta_fs(const struct file_meta *meta, int fd) {
+    dev_t dev = meta->st.st_dev;
+    uint64_t mnt_id = meta->mnt_id;
+    size_t start = (dev * 2654435761u ^ mnt_id) % FS_CACHE_SLOTS;
+    struct statfs sfs;
+
+    for (size_t i = 0; i < FS_CACHE_SLOTS; i++) {
+        struct fs_entry *entry = &fs_cache[(start + i) % FS_CACHE_SLOTS];
+        unsigned state = __atomic_load_n(&entry->state, __ATOMIC_ACQUIRE);
+
+        if (state == FS_EMPTY
+            && __atomic_compare_exchange_n(&entry->state, &state,
+                                           FS_CLAIMED, false,
+                                           __ATOMIC_ACQUIRE,
+                                           __ATOMIC_ACQUIRE)) {
+            copy_syscalls++;
+            if (fstatfs(fd, &sfs) < 0) {
+                __atomic_store_n(&entry->state, FS_EMPTY, __ATOMIC_RELEASE);
+                return NULL;
+            }
+            entry->dev = dev;
+            entry->mnt_id = mnt_id;
+            entry->fs.type = sfs.f_type;
+            __atomic_store_n(&entry->state, FS_READY, __ATOMIC_RELEASE);
+            return &entry->fs;
+        }
+        /* Only a statfs away from being ready, or given up on */
+        while (state == FS_CLAIMED)
+            state = __atomic_load_n(&entry->state, __ATOMIC_ACQUIRE);
+        if (state == FS_READY && entry->dev == dev && entry->mnt_id == mnt_id)
+            return &entry->fs;
+    }
+
+    /* Full, so look it up every time */
+    copy_syscalls++;
+    if (fstatfs(fd, &sfs) < 0)
+        return NULL;
+    fs_uncached = (struct fs_meta){ .type = sfs.f_type, };
+    return &fs_uncached;
+}
@@ -0,0 +1,51 @@
+
+/* ISC License                                                              */
+/*                                                                          */
+/* Copyright (c) 2016, Richard Maw                                          */
+/*                                                                          */
+/* Permission to use, copy, modify, and/or distribute this software for any */
+/* purpose with or without fee is hereby granted, provided that the above   */
+/* copyright notice and this permission notice appear in all copies.        */
+/*                                                                          */
+/* THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES */
+/* WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF         */
+/* MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR  */
+/* ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES   */
+/* WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN    */
+/* ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF  */
+/* OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.           */
+
+#pragma once
+
+#include <stdint.h>          /* uint64_t */
+#include <sys/stat.h>        /* struct stat */
+#include <time.h>            /* struct timespec */
+
+/* What a move knows about a file, from a single statx,
+   handed to everything that would otherwise stat it again. */
+struct file_meta {
+    struct stat st;
+    unsigned mask;               /* STATX_* fields statx filled in */
+    struct timespec btime;       /* if mask has STATX_BTIME */
+    uint64_t mnt_id;             /* if mask has STATX_MNT_ID */
+};
+
+/* What's known about the filesystem a file is on. */
+struct fs_meta {
+    long type;                   /* f_type from statfs */
+    int flags_taken[2];          /* FS_*_FL set on files and directories */
+    int flags_refused[2];        /* and those that couldn't be */
+};
+
+/* Fill meta for path relative to dirfd, as fstatat would with flags.
+   Falls back to fstatat, with nothing in mask, if statx isn't supported. */
+int file_meta_at(int dirfd, const char *path, int flags,
+                 struct file_meta *meta);
+
+/* Fill meta for the file open as fd. */
+int file_meta_fd(int fd, struct file_meta *meta);
+
+/* The filesystem of the file open as fd, described by meta.
+   Filesystems are looked up once per device and mount,
+   so it's only read from fd the first time. */
+struct fs_meta *file_meta_fs(const struct file_meta *meta, int fd);
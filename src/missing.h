@@ -45,3 +45,18 @@ static inline int copy_file_range(int fd_in, loff_t *off_in, int fd_out, loff_t
     return syscall(__NR_copy_file_range, fd_in, off_in, fd_out, off_out, len, flags);
 }
 #endif
+
+#include <fcntl.h>       /* O_TMPFILE, O_DIRECTORY */
+#ifndef O_TMPFILE
+#define O_TMPFILE (020000000 | O_DIRECTORY)
+#endif
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register 427
+#endif
@@ -0,0 +1,2596 @@
+
+/* ISC License                                                              */
+/*                                                                          */
+/* Copyright (c) 2016, Richard Maw                                          */
+/*                                                                          */
+/* Permission to use, copy, modify, and/or distribute this software for any */
+/* purpose with or without fee is hereby granted, provided that the above   */
+/* copyright notice and this permission notice appear in all copies.        */
+/*                                                                          */
+/* THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES */
+/* WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF         */
+/* MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR  */
+/* ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES   */
+/* WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN    */
+/* ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF  */
+/* OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.           */
+
+#include <assert.h>
+#include <stdbool.h>         /* bool, true, false */
+#include <limits.h>          /* PATH_MAX */
+#include <stdio.h>           /* sprintf */
+#include <sys/types.h>       /* mode_t */
+#include <unistd.h>          /* read, write, lseek, SEEK_{SET,CUR,DATA,HOLE}, syscall,
+                                access, getpid, linkat, fsync, syncfs */
+#include <time.h>            /* clock_gettime, struct timespec */
+#include <fcntl.h>           /* open, openat, splice, AT_*, O_TMPFILE,
+                                sync_file_range, SYNC_FILE_RANGE_WRITE */
+#include <dirent.h>          /* opendir, fdopendir, readdir, closedir, DT_* */
+#include <stdint.h>          /* uint64_t, int64_t */
+#include <sys/syscall.h>     /* SYS_getdents64 */
+#include <errno.h>           /* errno, E* */
+#include <sys/stat.h>        /* struct stat, futimens */
+#include <sys/ioctl.h>       /* ioctl */
+#include <libgen.h>          /* dirname */
+#undef basename
+#include <string.h>          /* basename */
+#include <linux/fs.h>        /* FS_IOC_*_FL */
+#include <strings.h>         /* ffs */
+#include <stdlib.h>          /* NULL, malloc, realloc, free, mkdtemp */
+#include <sys/xattr.h>       /* flistxattr, fgetxattr, fsetxattr */
+#include <selinux/selinux.h> /* freecon, setfscreatecon, selinux_status_* */
+#include <selinux/label.h>   /* selabel_{open,close,lookup}, SELABEL_CTX_FILE,
+                                selabel_handle */
+#include <pthread.h>         /* pthread_once, pthread_key_*, pthread_mutex_* */
+
+#include "fsops.h"           /* fsops_move, fsops_flush, fsops_last_error,
+                                struct fsops_opts, struct fsops_error,
+                                CLOBBER_*, SETGID_*, DURABILITY_* */
+#include "internal.h"        /* fsops_fail, fsops_clear_error, fsops_pool */
+#include "missing.h"         /* renameat2, RENAME_*, SEEK_*, copy_file_range */
+#include "copy.h"            /* copy_contents, struct copy_opts */
+#include "pool.h"            /* pool_* */
+#include "stats.h"           /* stats_*, STATS_* */
+#include "progress.h"        /* progress_* */
+#include "digest.h"          /* digest_*, struct digest */
+#include "meta.h"            /* file_meta_*, struct file_meta, struct fs_meta */
+
+struct move_opts {
+    enum clobber clobber;
+    enum setgid setgid;
+    int required_flags;
+    unsigned jobs;           /* tree copy workers, 0 for one per CPU */
+    struct copy_opts copy;   /* pool is set once the workers are needed */
+    bool resume;             /* carry on from an interrupted file copy */
+    bool verify;             /* check copies against their sources */
+    enum durability durability;  /* what's synced before sources go */
+};
+
+/* mode is of the file open as fd, which only ever changes type by being
+   replaced, so is taken from what's known of it rather than fstat. */
+static int get_flags(int fd, mode_t mode, int *flags_out) {
+	if (!S_ISREG(mode) && !S_ISDIR(mode) && !S_ISLNK(mode)) {
+		errno = ENOTTY;
+		return -1;
+	}
+	return STATS_SYSCALL(ioctl(fd, FS_IOC_GETFLAGS, flags_out));
+}
+
+static int set_flags(int fd, mode_t mode, const int *flags) {
+	if (!S_ISREG(mode) && !S_ISDIR(mode) && !S_ISLNK(mode)) {
+		errno = ENOTTY;
+		return -1;
+	}
+	return STATS_SYSCALL(ioctl(fd, FS_IOC_SETFLAGS, flags));
+}
+
+/* Update the flags of tgtfd to match srcfd.
+   srcfd and tgtfd must be regular files.
+   Flags are set one at a time since a filesystem may refuse to set new flags
+   if any of them are invalid, and the target's filesystem remembers
+   which it took and refused, so later files set the ones it took at once
+   and don't retry the ones it refused.
+   Failure to set any flags not in required_flags is ignored.
+ */
+static int copy_flags(int srcfd, const struct file_meta *srcmeta,
+                      int tgtfd, const struct file_meta *tgtmeta,
+                      int required_flags) {
+    mode_t tgtmode = tgtmeta->st.st_mode;
+    const struct fs_meta *srcfs;
+    struct fs_meta *tgtfs;
+    int isdir = S_ISDIR(tgtmode);
+    int taken, refused;
+    int ret;
+    int srcflags;
+    int tgtflags;
+    int newflags;
+
+    ret = get_flags(srcfd, srcmeta->st.st_mode, &srcflags);
+    if (ret != 0) {
+        /* If we don't support flags we have none to update. */
+        if (errno == EINVAL || errno == ENOTTY)
+            return 0;
+        return ret;
+    }
+
+    ret = get_flags(tgtfd, tgtmode, &tgtflags);
+    if (ret != 0) {
+        if (required_flags == 0 && (errno == EINVAL || errno == ENOTTY))
+            return 0;
+        return ret;
+    }
+
+    srcfs = file_meta_fs(srcmeta, srcfd);
+    if (srcfs == NULL)
+        return -1;
+
+    tgtfs = file_meta_fs(tgtmeta, tgtfd);
+    if (tgtfs == NULL)
+        return -1;
+
+    /* If on different fs need to mask to commonly agreed flags */
+    if (srcfs->type != tgtfs->type) {
+        srcflags &= FS_FL_USER_MODIFIABLE;
+        tgtflags &= FS_FL_USER_MODIFIABLE;
+        if ((srcflags & required_flags) != required_flags) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    /* Skip setting flags if they are the same */
+    if (srcflags == tgtflags)
+        return 0;
+
+    /* Clear any flags that are set which we want to remove,
+       along with setting those the filesystem has taken before */
+    taken = __atomic_load_n(&tgtfs->flags_taken[isdir], __ATOMIC_RELAXED);
+    refused = __atomic_load_n(&tgtfs->flags_refused[isdir], __ATOMIC_RELAXED);
+    newflags = (tgtflags & srcflags) | (srcflags & taken);
+    ret = 0;
+    if (newflags != tgtflags)
+        ret = set_flags(tgtfd, tgtmode, &newflags);
+    if (ret != 0 && (srcflags & taken & ~tgtflags)) {
+        /* Not for this file, so find which a flag at a time */
+        refused &= ~taken;
+        newflags = tgtflags & srcflags;
+        ret = set_flags(tgtfd, tgtmode, &newflags);
+    }
+    if (ret != 0) {
+        /* Can't set flags on the target, but we didn't require any. */
+        if (required_flags == 0 && errno == EINVAL)
+            return 0;
+        return ret;
+    }
+    tgtflags = newflags;
+
+    /* Use srcflags for flags we want to set,
+       which are everything not already set,
+       less any refused before that we don't require. */
+    srcflags &= ~tgtflags & ~(refused & ~required_flags);
+    while (srcflags) {
+        int flag = 1 << (ffs(srcflags) - 1);
+
+        newflags = tgtflags | flag;
+        ret = set_flags(tgtfd, tgtmode, &newflags);
+        /* Fail if this flag is required and unsettable */
+        if (ret != 0 && (flag & required_flags))
+            return ret;
+        if (ret == 0) {
+            tgtflags = newflags;
+            __atomic_fetch_or(&tgtfs->flags_taken[isdir], flag,
+                              __ATOMIC_RELAXED);
+        } else {
+            __atomic_fetch_or(&tgtfs->flags_refused[isdir], flag,
+                              __ATOMIC_RELAXED);
+        }
+
+        srcflags &= ~flag;
+    }
+
+    return 0;
+}
+
+/* The directory of the last target, kept open per thread with its stat,
+   so that a batch of moves into the same directory only looks it up once
+   and everything done in it is relative to it rather than a full path.
+   Tasks run while waiting on the workers may replace it,
+   so it's looked up again for each use rather than held. */
+static __thread struct {
+    char *path;
+    int fd;
+    struct stat st;
+    unsigned long generation;    /* of the move it was last checked by */
+} target_dir = { .path = NULL, .fd = -1, };
+
+/* Bumped by every move, since an earlier one may have renamed
+   a cached directory away, so each move checks a cache before using it. */
+static unsigned long target_dir_generation;
+
+/* Open the directory target is in, or reuse it if it was the last one,
+   and point *name at what target is called in it. */
+static int open_target_dir(const char *target, const char **name) {
+    size_t end = strlen(target);
+    const char *dir = ".";
+    size_t dirlen = 1;
+    unsigned long generation = __atomic_load_n(&target_dir_generation,
+                                               __ATOMIC_SEQ_CST);
+    struct stat st;
+    char *path;
+    int fd;
+
+    /* Trailing slashes stay on the name, as dirname would ignore them */
+    while (end > 1 && target[end - 1] == '/')
+        end--;
+    *name = target;
+    for (size_t i = end; i > 0; i--) {
+        if (target[i - 1] == '/') {
+            *name = target + i;
+            dir = target;
+            dirlen = i > 1 ? i - 1 : 1;
+            break;
+        }
+    }
+
+    if (target_dir.path != NULL && strlen(target_dir.path) == dirlen
+        && memcmp(target_dir.path, dir, dirlen) == 0) {
+        if (target_dir.generation == generation)
+            return target_dir.fd;
+        if (STATS_SYSCALL(stat(target_dir.path, &st)) == 0
+            && st.st_dev == target_dir.st.st_dev
+            && st.st_ino == target_dir.st.st_ino) {
+            target_dir.st = st;
+            target_dir.generation = generation;
+            return target_dir.fd;
+        }
+    }
+
+    path = strndup(dir, dirlen);
+    if (path == NULL)
+        return -1;
+    fd = STATS_SYSCALL(open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC));
+    if (fd < 0) {
+        free(path);
+        return fd;
+    }
+    if (STATS_SYSCALL(fstat(fd, &st)) < 0) {
+        close(fd);
+        free(path);
+        return -1;
+    }
+
+    free(target_dir.path);
+    if (target_dir.fd >= 0)
+        close(target_dir.fd);
+    target_dir.path = path;
+    target_dir.fd = fd;
+    target_dir.st = st;
+    target_dir.generation = generation;
+    return fd;
+}
+
+/* target_stat is what's known of tgtfd, or NULL to fstat it if needed. */
+static int fix_owner(const char *target, struct stat *source_stat,
+                     enum setgid setgid, int tgtfd,
+                     const struct stat *target_stat) {
+    struct stat st;
+    const char *name;
+    int ret = 0;
+
+    /* fchownat with AT_EMPTY_PATH rather than fchown
+       so that O_PATH descriptors of symlinks and device nodes work. */
+    if (setgid == SETGID_NEVER) {
+        ret = STATS_SYSCALL(fchownat(tgtfd, "", source_stat->st_uid,
+                                     source_stat->st_gid, AT_EMPTY_PATH));
+        if (ret < 0)
+            fsops_fail("Chown target");
+        return ret;
+    }
+
+    if (target_stat == NULL) {
+        ret = STATS_SYSCALL(fstat(tgtfd, &st));
+        if (ret < 0) {
+            fsops_fail("Stat target file");
+            return ret;
+        }
+        target_stat = &st;
+    }
+
+    ret = open_target_dir(target, &name);
+    if (ret < 0) {
+        fsops_fail("Open target directory");
+        return ret;
+    }
+    ret = 0;
+
+    if ((setgid == SETGID_ALWAYS
+         || (setgid == SETGID_AUTO && target_dir.st.st_mode & S_ISGID))
+        && target_stat->st_gid != target_dir.st.st_gid) {
+        ret = STATS_SYSCALL(fchownat(tgtfd, "", target_stat->st_uid,
+                                     target_dir.st.st_gid, AT_EMPTY_PATH));
+        if (ret < 0)
+            fsops_fail("Chown target");
+    }
+
+    return ret;
+}
+
+static int fix_rename_owner(const char *target, struct stat *source_stat,
+                            enum setgid setgid) {
+    const char *name;
+    int tgtfd = -1;
+    int ret = -1;
+
+    ret = open_target_dir(target, &name);
+    if (ret < 0) {
+        fsops_fail("Open target directory");
+        goto cleanup;
+    }
+    /* O_PATH so directories and symlinks can be reopened too */
+    ret = STATS_SYSCALL(openat(ret, name, O_PATH|O_NOFOLLOW));
+    if (ret == -1) {
+        fsops_fail("Open target file");
+        goto cleanup;
+    }
+    tgtfd = ret;
+
+    ret = fix_owner(target, source_stat, setgid, tgtfd, NULL);
+cleanup:
+    close(tgtfd);
+    return ret;
+}
+
+/* Buffers for copying xattrs, kept per thread and only ever grown,
+   so once they're big enough copying a file's xattrs allocates nothing.
+   Names and values have a buffer each so a value can be fetched
+   while the list of names is being walked. */
+#define XATTR_ARENA_MIN 4096
+
+static __thread struct {
+    char *names;
+    size_t names_size;
+    char *value;
+    size_t value_size;
+} xattr_arena;
+
+static int arena_grow(char **buf, size_t *size, size_t want) {
+    size_t new_size = *size ? *size : XATTR_ARENA_MIN;
+    char *new_buf;
+
+    while (new_size < want)
+        new_size *= 2;
+    if (new_size == *size)
+        return 0;
+    new_buf = realloc(*buf, new_size);
+    if (new_buf == NULL)
+        return -1;
+    *buf = new_buf;
+    *size = new_size;
+    return 0;
+}
+
+/* List fd's xattr names into the arena, returning the length of the list.
+   The buffer is only sized to fit if the names didn't already. */
+static ssize_t xattr_list(int fd) {
+    ssize_t ret;
+
+    if (arena_grow(&xattr_arena.names, &xattr_arena.names_size, 1) < 0)
+        return -1;
+    for (;;) {
+        ret = TEMP_FAILURE_RETRY(STATS_SYSCALL(
+            flistxattr(fd, xattr_arena.names, xattr_arena.names_size)));
+        if (ret >= 0 || errno != ERANGE)
+            return ret;
+
+        ret = TEMP_FAILURE_RETRY(STATS_SYSCALL(flistxattr(fd, NULL, 0)));
+        if (ret < 0)
+            return ret;
+        /* May have grown again before the next flistxattr */
+        if (arena_grow(&xattr_arena.names, &xattr_arena.names_size,
+                       ret + 1) < 0)
+            return -1;
+    }
+}
+
+/* Fetch the value of name into the arena, returning its length. */
+static ssize_t xattr_get(int fd, const char *name) {
+    ssize_t ret;
+
+    if (arena_grow(&xattr_arena.value, &xattr_arena.value_size, 1) < 0)
+        return -1;
+    for (;;) {
+        ret = TEMP_FAILURE_RETRY(STATS_SYSCALL(
+            fgetxattr(fd, name, xattr_arena.value, xattr_arena.value_size)));
+        if (ret >= 0 || errno != ERANGE)
+            return ret;
+
+        ret = TEMP_FAILURE_RETRY(STATS_SYSCALL(fgetxattr(fd, name, NULL, 0)));
+        if (ret < 0)
+            return ret;
+        if (arena_grow(&xattr_arena.value, &xattr_arena.value_size,
+                       ret + 1) < 0)
+            return -1;
+    }
+}
+
+/* The namespaces copy_xattrs copies, and whether one the target
+   doesn't support is skipped, rather than the copy failing. */
+#define XATTR_PREFIX(prefix, optional) { prefix, sizeof(prefix) - 1, optional }
+
+static const struct xattr_prefix {
+    const char *prefix;
+    size_t len;
+    bool optional;
+} xattr_prefixes[] = {
+    XATTR_PREFIX("user.", false),
+    XATTR_PREFIX("security.SMACK64", true),
+    XATTR_PREFIX("btrfs.", true),
+};
+
+static const struct xattr_prefix *xattr_prefix_find(const char *name,
+                                                    size_t len) {
+    for (size_t i = 0; i < sizeof xattr_prefixes / sizeof *xattr_prefixes;
+         i++) {
+        const struct xattr_prefix *prefix = &xattr_prefixes[i];
+        if (len >= prefix->len
+            && memcmp(name, prefix->prefix, prefix->len) == 0)
+            return prefix;
+    }
+    return NULL;
+}
+
+static int copy_xattrs(int srcfd, int tgtfd) {
+    ssize_t names_len;
+    ssize_t ret;
+
+    names_len = xattr_list(srcfd);
+    if (names_len < 0)
+        return -1;
+
+    ret = 0;
+    for (size_t off = 0, len; off < names_len; off += len + 1) {
+        const char *name = xattr_arena.names + off;
+        const struct xattr_prefix *prefix;
+
+        len = strlen(name);
+        /* Skip xattrs that need special handling */
+        prefix = xattr_prefix_find(name, len);
+        if (prefix == NULL)
+            continue;
+
+        ret = xattr_get(srcfd, name);
+        if (ret < 0)
+            return -1;
+
+        ret = TEMP_FAILURE_RETRY(STATS_SYSCALL(
+            fsetxattr(tgtfd, name, xattr_arena.value, ret, 0)));
+        if (ret < 0) {
+            if (errno == EINVAL && prefix->optional) {
+                ret = 0;
+                continue;
+            }
+            return -1;
+        }
+    }
+
+    return ret;
+}
+
+/* Opening the labeling handle parses the whole file_contexts database,
+   so it is opened once and kept for every file the process copies,
+   and reopened only when the kernel reports a policy change.
+
+   Lookups are remembered by the target's directory and file type,
+   so a directory of files takes one lookup per type.
+   This assumes file_contexts doesn't label files in the same directory
+   differently by name, which holds for the trees we move into.
+   The cache is only used while the SELinux status page can tell us
+   when the policy has been reloaded. */
+#define SELABEL_CACHE_BUCKETS 256
+#define SELABEL_CACHE_MAX 4096
+
+struct selabel_entry {
+    struct selabel_entry *next;
+    mode_t type;
+    size_t dirlen;
+    char *context;
+    char dir[];
+};
+
+static struct selabel_handle *selabel_hnd;
+static int selabel_open_errno;
+static bool selabel_status;
+static struct selabel_entry *selabel_cache[SELABEL_CACHE_BUCKETS];
+static size_t selabel_cache_size;
+static pthread_once_t selabel_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t selabel_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void selabel_cache_flush(void) {
+    for (size_t i = 0; i < SELABEL_CACHE_BUCKETS; i++) {
+        while (selabel_cache[i] != NULL) {
+            struct selabel_entry *entry = selabel_cache[i];
+            selabel_cache[i] = entry->next;
+            freecon(entry->context);
+            free(entry);
+        }
+    }
+    selabel_cache_size = 0;
+}
+
+static size_t selabel_cache_hash(const char *dir, size_t dirlen, mode_t type) {
+    size_t hash = 2166136261u;
+    for (size_t i = 0; i < dirlen; i++)
+        hash = (hash ^ (unsigned char)dir[i]) * 16777619u;
+    hash = (hash ^ (type >> 12)) * 16777619u;
+    return hash % SELABEL_CACHE_BUCKETS;
+}
+
+static void open_selabel(void) {
+    selabel_hnd = selabel_open(SELABEL_CTX_FILE, NULL, 0);
+    if (selabel_hnd == NULL) {
+        selabel_open_errno = errno;
+        return;
+    }
+    /* Without a fallback so we never poll netlink on every lookup */
+    selabel_status = selinux_status_open(0) == 0;
+}
+
+/* Look up the context for tgt, with selabel_lock held. */
+static int selabel_cached_lookup(char **context, const char *tgt,
+                                 mode_t srcmode) {
+    const char *slash = strrchr(tgt, '/');
+    size_t dirlen = slash ? slash - tgt : 0;
+    mode_t type = srcmode & S_IFMT;
+    struct selabel_entry *entry;
+    size_t bucket;
+    int ret;
+
+    if (!selabel_status)
+        return selabel_lookup(selabel_hnd, context, tgt, srcmode);
+
+    if (selinux_status_updated() > 0) {
+        struct selabel_handle *hnd = selabel_open(SELABEL_CTX_FILE, NULL, 0);
+        if (hnd != NULL) {
+            selabel_close(selabel_hnd);
+            selabel_hnd = hnd;
+        }
+        selabel_cache_flush();
+    }
+
+    bucket = selabel_cache_hash(tgt, dirlen, type);
+    for (entry = selabel_cache[bucket]; entry != NULL; entry = entry->next) {
+        if (entry->type == type && entry->dirlen == dirlen
+            && memcmp(entry->dir, tgt, dirlen) == 0) {
+            *context = strdup(entry->context);
+            return *context == NULL ? -1 : 0;
+        }
+    }
+
+    ret = selabel_lookup(selabel_hnd, context, tgt, srcmode);
+    if (ret != 0)
+        return ret;
+
+    if (selabel_cache_size >= SELABEL_CACHE_MAX)
+        selabel_cache_flush();
+
+    /* Failing to remember the result only costs the next lookup */
+    entry = malloc(sizeof *entry + dirlen);
+    if (entry == NULL)
+        return 0;
+    entry->context = strdup(*context);
+    if (entry->context == NULL) {
+        free(entry);
+        return 0;
+    }
+    entry->type = type;
+    entry->dirlen = dirlen;
+    memcpy(entry->dir, tgt, dirlen);
+    entry->next = selabel_cache[bucket];
+    selabel_cache[bucket] = entry;
+    selabel_cache_size++;
+
+    return 0;
+}
+
+static int set_selinux_create_context(const char *tgt, mode_t srcmode) {
+    int ret = 0;
+    char *context = NULL;
+
+    pthread_once(&selabel_once, open_selabel);
+    if (selabel_hnd == NULL) {
+        if (selabel_open_errno != ENOENT) {
+            errno = selabel_open_errno;
+            ret = 1;
+        }
+        goto cleanup;
+    }
+
+    pthread_mutex_lock(&selabel_lock);
+    ret = selabel_cached_lookup(&context, tgt, srcmode);
+    pthread_mutex_unlock(&selabel_lock);
+    if (ret != 0) {
+        goto cleanup;
+    }
+
+    ret = STATS_SYSCALL(setfscreatecon(context));
+
+cleanup:
+    freecon(context);
+    return ret;
+}
+
+static int copy_posix_acl(int srcfd, int tgtfd, const char *name) {
+    ssize_t ret;
+
+    ret = xattr_get(srcfd, name);
+    if (ret < 0)
+        return errno == ENODATA ? 0 : -1;
+
+    return TEMP_FAILURE_RETRY(STATS_SYSCALL(fsetxattr(tgtfd, name,
+                                                      xattr_arena.value,
+                                                      ret, 0)));
+}
+
+static int copy_posix_acls(int srcfd, int tgtfd, mode_t mode) {
+    int ret;
+
+    ret = copy_posix_acl(srcfd, tgtfd, "system.posix_acl_access");
+    if (ret < 0 || !S_ISDIR(mode))
+        return ret;
+
+    return copy_posix_acl(srcfd, tgtfd, "system.posix_acl_default");
+}
+
+/* Remove name relative to parentfd, recursing into it if it's a directory. */
+static int remove_tree_at(int parentfd, const char *name) {
+    DIR *dir = NULL;
+    int fd = -1;
+    int ret;
+
+    ret = STATS_SYSCALL(unlinkat(parentfd, name, 0));
+    if (ret == 0 || errno != EISDIR)
+        return ret;
+
+    fd = STATS_SYSCALL(openat(parentfd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW));
+    if (fd < 0)
+        return fd;
+    dir = fdopendir(fd);
+    if (dir == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    ret = 0;
+    for (;;) {
+        struct dirent *ent;
+        errno = 0;
+        ent = readdir(dir);
+        if (ent == NULL) {
+            if (errno != 0)
+                ret = -1;
+            break;
+        }
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+
+        ret = remove_tree_at(dirfd(dir), ent->d_name);
+        if (ret < 0)
+            break;
+    }
+    closedir(dir);
+    if (ret < 0)
+        return ret;
+
+    return STATS_SYSCALL(unlinkat(parentfd, name, AT_REMOVEDIR));
+}
+
+/* Rename src relative to srcdirfd over tgt relative to tgtdirfd. */
+static int rename_file(int srcdirfd, const char *src, int tgtdirfd,
+                       const char *tgt, enum clobber clobber) {
+    int ret = -1;
+    int renameflags = 0;
+
+    switch (clobber) {
+        case CLOBBER_REQUIRED:
+        case CLOBBER_TRY_REQUIRED:
+            renameflags = RENAME_EXCHANGE;
+            break;
+        case CLOBBER_FORBIDDEN:
+        case CLOBBER_TRY_FORBIDDEN:
+            renameflags = RENAME_NOREPLACE;
+            break;
+        case CLOBBER_PERMITTED:
+            break;
+        default:
+            assert(0);
+    }
+
+    ret = STATS_SYSCALL(renameat2(srcdirfd, src, tgtdirfd, tgt, renameflags));
+    if (ret == 0) {
+        /* What was exchanged out may be a whole directory tree */
+        if (clobber == CLOBBER_REQUIRED || clobber == CLOBBER_TRY_REQUIRED) {
+            ret = remove_tree_at(srcdirfd, src);
+        }
+        return ret;
+    }
+
+    if ((errno == ENOSYS || errno == EINVAL)
+        && (clobber != CLOBBER_REQUIRED
+            && clobber != CLOBBER_FORBIDDEN)) {
+        ret = STATS_SYSCALL(renameat(srcdirfd, src, tgtdirfd, tgt));
+    }
+
+cleanup:
+    return ret;
+}
+
+/* Make a mkstemp template for a temporary next to target. */
+static char *tmp_template(const char *target) {
+    char *template = malloc(strlen(target) + sizeof("./.tmpXXXXXX"));
+    char *dir = NULL;
+    if (template == NULL)
+        return NULL;
+    strcpy(template, target);
+    dir = dirname(template);
+    if (dir != template)
+        strcpy(template, dir);
+    strcat(template, "/");
+    strcat(template, ".tmp");
+    strcat(template, basename(target));
+    strcat(template, "XXXXXX");
+    return template;
+}
+
+/* Replace the XXXXXX at the end of template with something unlikely to exist */
+static void fill_template(char *template) {
+    static const char chars[] = "abcdefghijklmnopqrstuvwxyz"
+                                "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    static unsigned long counter;
+    char *x = template + strlen(template) - 6;
+    struct timespec ts;
+    unsigned long v;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    v = ts.tv_nsec ^ ((unsigned long)getpid() << 16)
+        ^ __atomic_fetch_add(&counter, 7919, __ATOMIC_RELAXED);
+    for (int i = 0; i < 6; i++, v /= sizeof(chars) - 1)
+        x[i] = chars[v % (sizeof(chars) - 1)];
+}
+
+/* Open an unnamed file in target's directory with O_TMPFILE,
+   so nothing is left behind if we crash before link_tmpfile names it,
+   and set *tmpfn_out to NULL.
+   Falls back to a new file next to target, named in *tmpfn_out
+   relative to the directory from open_target_dir. */
+static int open_tmpfile(const char *target, char **tmpfn_out) {
+    static int have_tmpfile = -1;
+    const char *name;
+    char *template;
+    int use_tmpfile;
+    int dirfd;
+    int ret;
+
+    dirfd = open_target_dir(target, &name);
+    if (dirfd < 0)
+        return dirfd;
+
+    /* The unnamed file is linked in by its /proc/self/fd path.
+       Workers racing to find out all get the same answer. */
+    use_tmpfile = __atomic_load_n(&have_tmpfile, __ATOMIC_RELAXED);
+    if (use_tmpfile < 0) {
+        use_tmpfile = STATS_SYSCALL(access("/proc/self/fd", X_OK)) == 0;
+        __atomic_store_n(&have_tmpfile, use_tmpfile, __ATOMIC_RELAXED);
+    }
+    if (use_tmpfile) {
+        ret = STATS_SYSCALL(openat(dirfd, ".", O_TMPFILE|O_RDWR|O_CLOEXEC,
+                                   0600));
+        if (ret >= 0) {
+            *tmpfn_out = NULL;
+            return ret;
+        }
+        /* Unsupported by the filesystem, or EISDIR from old kernels */
+        if (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)
+            return ret;
+    }
+
+    /* mkstemp, but relative to dirfd */
+    template = tmp_template(name);
+    if (template == NULL)
+        return -1;
+    for (int tries = 0;; tries++) {
+        fill_template(template);
+        ret = STATS_SYSCALL(openat(dirfd, template,
+                                   O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0600));
+        if (ret >= 0 || errno != EEXIST || tries == 100)
+            break;
+    }
+    if (ret >= 0)
+        *tmpfn_out = template;
+    else
+        free(template);
+    return ret;
+}
+
+/* Name the unnamed file fd from open_tmpfile as target.
+   linkat can't replace a file, so unless clobbering is forbidden
+   it's linked to a temporary name that is renamed over target instead. */
+static int link_tmpfile(int fd, const char *target, enum clobber clobber) {
+    char procpath[sizeof("/proc/self/fd/") + 3 * sizeof(int)];
+    char *tmppath = NULL;
+    const char *name;
+    int dirfd;
+    int ret;
+
+    sprintf(procpath, "/proc/self/fd/%d", fd);
+    dirfd = open_target_dir(target, &name);
+    if (dirfd < 0)
+        return dirfd;
+
+    if (clobber != CLOBBER_REQUIRED && clobber != CLOBBER_TRY_REQUIRED) {
+        ret = STATS_SYSCALL(linkat(AT_FDCWD, procpath, dirfd, name,
+                                   AT_SYMLINK_FOLLOW));
+        if (ret == 0 || errno != EEXIST || clobber != CLOBBER_PERMITTED)
+            return ret;
+    }
+
+    tmppath = tmp_template(name);
+    if (tmppath == NULL)
+        return -1;
+    for (int tries = 0;; tries++) {
+        fill_template(tmppath);
+        ret = STATS_SYSCALL(linkat(AT_FDCWD, procpath, dirfd, tmppath,
+                                   AT_SYMLINK_FOLLOW));
+        if (ret == 0 || errno != EEXIST || tries == 100)
+            break;
+    }
+    if (ret < 0) {
+        fsops_fail("Link temporary target file");
+        goto cleanup;
+    }
+
+    ret = rename_file(dirfd, tmppath, dirfd, name, clobber);
+    if (ret != 0)
+        (void)STATS_SYSCALL(unlinkat(dirfd, tmppath, 0));
+cleanup:
+    free(tmppath);
+    return ret;
+}
+
+/* Resumable copies are staged in a file named after target,
+   so a rerun finds it, with a journal next to it: a header identifying
+   the source being copied, then a record of each range of the staging file
+   synced to disk. A rerun copies what's after those ranges
+   if the source is unchanged, or starts again if it isn't. */
+#define RESUME_MAGIC "fsopsrj1"
+#define RESUME_INTERVAL (256 * 1024 * 1024)
+
+struct resume_header {
+    char magic[8];
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+};
+
+struct resume_range {
+    int64_t start;
+    int64_t end;
+};
+
+struct resume {
+    char *journal;               /* in the target's directory */
+    int journalfd;
+    int tgtfd;                   /* the staging file */
+    off_t journal_end;           /* where the next range is recorded */
+    loff_t committed;            /* synced from the start of the file */
+};
+
+/* The name of a file for a resumable copy to name, in the same directory. */
+static char *resume_path(const char *name, const char *suffix) {
+    char *template = tmp_template(name);
+    char *path = NULL;
+
+    if (template == NULL)
+        return NULL;
+    template[strlen(template) - strlen("XXXXXX")] = '\0';
+    path = malloc(strlen(template) + strlen(suffix) + 1);
+    if (path != NULL) {
+        strcpy(path, template);
+        strcat(path, suffix);
+    }
+    free(template);
+    return path;
+}
+
+/* Open the staging file for a resumable copy of source to target,
+   naming it in *tmpfn_out relative to the directory from open_target_dir,
+   with rs set up to carry on from what an earlier attempt committed,
+   if it was of the same source. */
+static int open_resumable(const char *target, const struct stat *source_stat,
+                          char **tmpfn_out, struct resume *rs) {
+    struct resume_header want, have;
+    struct resume_range range;
+    const char *name;
+    char *path = NULL;
+    int dirfd;
+    int ret = -1;
+
+    memset(&want, 0, sizeof want);
+    memcpy(want.magic, RESUME_MAGIC, sizeof want.magic);
+    want.dev = source_stat->st_dev;
+    want.ino = source_stat->st_ino;
+    want.size = source_stat->st_size;
+    want.mtime_sec = source_stat->st_mtim.tv_sec;
+    want.mtime_nsec = source_stat->st_mtim.tv_nsec;
+    want.ctime_sec = source_stat->st_ctim.tv_sec;
+    want.ctime_nsec = source_stat->st_ctim.tv_nsec;
+
+    dirfd = open_target_dir(target, &name);
+    if (dirfd < 0)
+        goto error;
+    path = resume_path(name, ".part");
+    rs->journal = resume_path(name, ".journal");
+    if (path == NULL || rs->journal == NULL)
+        goto error;
+
+    rs->journalfd = STATS_SYSCALL(openat(dirfd, rs->journal,
+                                         O_RDWR|O_CREAT|O_CLOEXEC, 0600));
+    if (rs->journalfd < 0)
+        goto error;
+    rs->tgtfd = STATS_SYSCALL(openat(dirfd, path, O_RDWR|O_CREAT|O_CLOEXEC,
+                                     0600));
+    if (rs->tgtfd < 0)
+        goto error;
+
+    rs->committed = 0;
+    rs->journal_end = sizeof have;
+    if (STATS_SYSCALL(pread(rs->journalfd, &have, sizeof have, 0))
+            == sizeof have
+        && memcmp(&have, &want, sizeof want) == 0) {
+        /* Ranges are recorded in order, and a torn last one is ignored */
+        while (STATS_SYSCALL(pread(rs->journalfd, &range, sizeof range,
+                                   rs->journal_end)) == sizeof range) {
+            if (range.start <= rs->committed && range.end > rs->committed)
+                rs->committed = range.end;
+            rs->journal_end += sizeof range;
+        }
+        *tmpfn_out = path;
+        return rs->tgtfd;
+    }
+
+    /* Nothing usable was staged, so start from scratch */
+    if (STATS_SYSCALL(ftruncate(rs->tgtfd, 0)) < 0
+        || STATS_SYSCALL(ftruncate(rs->journalfd, 0)) < 0
+        || STATS_SYSCALL(pwrite(rs->journalfd, &want, sizeof want, 0))
+           != sizeof want
+        || STATS_SYSCALL(fdatasync(rs->journalfd)) < 0)
+        goto error;
+    *tmpfn_out = path;
+    return rs->tgtfd;
+
+error:
+    if (rs->tgtfd >= 0)
+        close(rs->tgtfd);
+    if (rs->journalfd >= 0)
+        close(rs->journalfd);
+    rs->tgtfd = rs->journalfd = -1;
+    free(path);
+    return ret;
+}
+
+/* Record that everything before offset in the staging file is copied,
+   once it's on disk, so a rerun doesn't copy it again. */
+static int resume_checkpoint(void *arg, loff_t offset) {
+    struct resume *rs = arg;
+    struct resume_range range = { .start = rs->committed, .end = offset, };
+
+    if (STATS_SYSCALL(fdatasync(rs->tgtfd)) < 0
+        || STATS_SYSCALL(pwrite(rs->journalfd, &range, sizeof range,
+                                rs->journal_end)) != sizeof range
+        || STATS_SYSCALL(fdatasync(rs->journalfd)) < 0) {
+        fsops_fail("Record copy checkpoint");
+        return -1;
+    }
+    rs->journal_end += sizeof range;
+    rs->committed = offset;
+    return 0;
+}
+
+/* Copy the data of source into the staging file of a resumable copy,
+   after what an earlier attempt committed. */
+static ssize_t copy_resumable(int srcfd, struct resume *rs,
+                              const struct copy_opts *copy) {
+    struct copy_checkpoint checkpoint = {
+        .interval = RESUME_INTERVAL,
+        .fn = resume_checkpoint,
+        .arg = rs,
+    };
+    struct copy_opts resumed = *copy;
+    struct file_meta target;
+    ssize_t ret;
+
+    /* Holes in the source aren't written, so uncommitted data
+       from the last attempt would be left in them if not truncated */
+    if (STATS_SYSCALL(ftruncate(rs->tgtfd, rs->committed)) < 0) {
+        fsops_fail("Truncate uncommitted data");
+        return -1;
+    }
+    if (STATS_SYSCALL(lseek(srcfd, rs->committed, SEEK_SET)) == (off_t)-1
+        || STATS_SYSCALL(lseek(rs->tgtfd, rs->committed, SEEK_SET))
+           == (off_t)-1) {
+        fsops_fail("Seek past committed data");
+        return -1;
+    }
+    progress_add(rs->committed);
+
+    /* What's known of the target is from before it was truncated */
+    if (copy->target != NULL) {
+        target = *copy->target;
+        target.st.st_size = rs->committed;
+        resumed.target = &target;
+    }
+
+    ret = copy_contents_checkpointed(srcfd, rs->tgtfd, &checkpoint, &resumed);
+    if (ret < 0)
+        return ret;
+    return ret + rs->committed;
+}
+
+/* Checking a copy against its source. The copy hashes the source data
+   it reads itself, and what went through the kernel is read back
+   by pool workers while the metadata is copied. */
+struct verify_file {
+    struct verify *verify;
+    struct digest digest;
+    int fd;
+    int directfd;                /* fd opened with O_DIRECT, or -1 */
+    bool read;                   /* whether it has to be read back */
+};
+
+struct verify {
+    struct pool *pool;           /* to read back on, or NULL to do it inline */
+    loff_t size;
+    struct verify_file source;
+    struct verify_file target;
+    unsigned long outstanding;   /* read backs still running */
+    unsigned long long syscalls; /* made by whichever threads read back */
+    int error;                   /* errno of the first failed read back */
+};
+
+static void verify_init(struct verify *v, loff_t size, struct pool *pool) {
+    *v = (struct verify){
+        .pool = pool,
+        .size = size,
+        .source = { .verify = v, .fd = -1, .directfd = -1, },
+        .target = { .verify = v, .fd = -1, .directfd = -1, },
+    };
+    digest_init(&v->source.digest, size);
+    digest_init(&v->target.digest, size);
+}
+
+static void verify_read(struct pool *pool, void *arg) {
+    struct verify_file *file = arg;
+    struct verify *v = file->verify;
+    unsigned long long syscalls = copy_syscalls;
+
+    if (digest_file(&file->digest, file->fd, file->directfd) < 0) {
+        int expected = 0;
+        __atomic_compare_exchange_n(&v->error, &expected, errno, false,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    }
+
+    /* Counted for the thread the copy was started on instead */
+    syscalls = copy_syscalls - syscalls;
+    copy_syscalls -= syscalls;
+    __atomic_fetch_add(&v->syscalls, syscalls, __ATOMIC_RELAXED);
+    if (pool != NULL)
+        pool_done(pool, &v->outstanding);
+}
+
+/* Start reading back the target, and the source if the copy didn't
+   see all of it, once the data has been copied.
+   The files are opened again now since the metadata copied next
+   may take away permission to. */
+static void verify_start(struct verify *v, int srcfd, int tgtfd) {
+    struct verify_file *files[] = { &v->source, &v->target, };
+
+    v->target.read = true;
+    if (v->source.digest.partial) {
+        v->source.read = true;
+        digest_init(&v->source.digest, v->size);
+    }
+    v->source.fd = srcfd;
+    v->target.fd = tgtfd;
+
+    for (size_t i = 0; i < sizeof files / sizeof *files; i++) {
+        struct verify_file *file = files[i];
+        if (!file->read)
+            continue;
+        file->directfd = digest_open_direct(file->fd);
+        if (v->pool == NULL)
+            continue;
+        v->outstanding++;
+        if (pool_submit(v->pool, verify_read, file) < 0) {
+            v->outstanding--;
+            /* Read it back when waiting instead */
+            continue;
+        }
+        file->read = false;
+    }
+}
+
+/* Wait for the read backs and finish any that couldn't be queued. */
+static void verify_wait(struct verify *v) {
+    if (v->pool != NULL)
+        pool_wait_for(v->pool, &v->outstanding);
+    if (v->source.read)
+        verify_read(NULL, &v->source);
+    if (v->target.read)
+        verify_read(NULL, &v->target);
+    v->source.read = v->target.read = false;
+    copy_syscalls += v->syscalls;
+    v->syscalls = 0;
+    if (v->source.directfd >= 0)
+        close(v->source.directfd);
+    if (v->target.directfd >= 0)
+        close(v->target.directfd);
+    v->source.directfd = v->target.directfd = -1;
+}
+
+/* Wait for the read backs and compare the target with the source,
+   failing with EIO if they differ. */
+static int verify_finish(struct verify *v) {
+    struct stat st;
+
+    verify_wait(v);
+    if (v->error != 0) {
+        errno = v->error;
+        fsops_fail("Read back copy");
+        return -1;
+    }
+    if (STATS_SYSCALL(fstat(v->target.fd, &st)) < 0) {
+        fsops_fail("Stat copy");
+        return -1;
+    }
+    /* Zeros at the end add nothing to a digest, so sizes are compared too */
+    if (st.st_size != v->size || v->source.digest.partial
+        || v->target.digest.partial
+        || v->source.digest.crc != v->target.digest.crc) {
+        errno = EIO;
+        fsops_fail("Verify copy");
+        return -1;
+    }
+    return 0;
+}
+
+static int copy_file(const char *source, const char *target,
+                     struct file_meta *source_meta,
+                     enum clobber clobber, enum setgid setgid,
+                     int required_flags, const struct copy_opts *copy,
+                     bool resume, bool verify, enum durability durability) {
+    struct stat *source_stat = &source_meta->st;
+    struct stats_mark mark;
+    struct resume rs = { .journalfd = -1, .tgtfd = -1, };
+    struct file_meta target_meta;
+    struct copy_opts known;
+    struct verify v;
+    bool verifying = false;
+    bool discard = false;
+    int srcfd = -1;
+    int tgtfd = -1;
+    int ret = -1;
+    ssize_t copied;
+    char *tmppath = NULL;
+    const char *name;
+    int dirfd = -1;
+
+    stats_start(&mark);
+    ret = STATS_SYSCALL(open(source, O_RDONLY));
+    if (ret == -1) {
+        fsops_fail("Open source file");
+        goto cleanup;
+    }
+    srcfd = ret;
+    stats_phase(&mark, STATS_OPEN, 0);
+
+    ret = set_selinux_create_context(target, source_stat->st_mode);
+    if (ret != 0) {
+        fsops_fail("Set selinux create context");
+        goto cleanup;
+    }
+    stats_phase(&mark, STATS_SELINUX, 0);
+
+    if (resume)
+        ret = open_resumable(target, source_stat, &tmppath, &rs);
+    else
+        ret = open_tmpfile(target, &tmppath);
+    if (ret == -1) {
+        fsops_fail("Open temporary target file");
+        goto cleanup;
+    }
+    tgtfd = ret;
+
+    /* The one stat of the target, for everything after */
+    ret = file_meta_fd(tgtfd, &target_meta);
+    if (ret < 0) {
+        fsops_fail("Stat target file");
+        goto cleanup;
+    }
+    known = *copy;
+    known.source = source_meta;
+    known.target = &target_meta;
+    copy = &known;
+    stats_phase(&mark, STATS_TMPFILE, 0);
+
+    if (verify) {
+        verify_init(&v, source_stat->st_size, copy->pool);
+        known.digest = &v.source.digest;
+        /* What was copied before resuming wasn't seen by this copy */
+        if (resume && rs.committed > 0)
+            digest_skip(&v.source.digest);
+    }
+
+    if (resume)
+        copied = copy_resumable(srcfd, &rs, copy);
+    else
+        copied = copy_contents(srcfd, tgtfd, copy);
+    if (copied < 0) {
+        fsops_fail("Copy file contents");
+        ret = -1;
+        goto cleanup;
+    }
+    stats_phase(&mark, STATS_DATA, copied);
+
+    /* Start writing the data out while the metadata is copied,
+       so there's less left for the batch's sync to wait for */
+    if (durability == DURABILITY_BATCH)
+        (void)STATS_SYSCALL(sync_file_range(tgtfd, 0, 0,
+                                            SYNC_FILE_RANGE_WRITE));
+
+    if (verify) {
+        verify_start(&v, srcfd, tgtfd);
+        verifying = true;
+    }
+
+    ret = STATS_SYSCALL(fchmod(tgtfd, source_stat->st_mode));
+    if (ret < 0) {
+        fsops_fail("Chmod target");
+        goto cleanup;
+    }
+    stats_phase(&mark, STATS_CHMOD, 0);
+
+    ret = fix_owner(target, source_stat, setgid, tgtfd, &target_meta.st);
+    if (ret < 0)
+        goto cleanup;
+    stats_phase(&mark, STATS_OWNER, 0);
+
+    ret = copy_flags(srcfd, source_meta, tgtfd, &target_meta, required_flags);
+    if (ret < 0) {
+        fsops_fail("Copy inode flags");
+        goto cleanup;
+    }
+    stats_phase(&mark, STATS_FLAGS, 0);
+
+    ret = copy_xattrs(srcfd, tgtfd);
+    if (ret < 0) {
+        fsops_fail("Copy xattrs");
+        goto cleanup;
+    }
+    stats_phase(&mark, STATS_XATTRS, 0);
+
+    ret = copy_posix_acls(srcfd, tgtfd, source_stat->st_mode);
+    if (ret < 0) {
+        fsops_fail("Copy POSIX ACLs");
+        goto cleanup;
+    }
+    stats_phase(&mark, STATS_ACLS, 0);
+
+    {
+        struct timespec times[] = { source_stat->st_atim, source_stat->st_mtim, };
+        ret = STATS_SYSCALL(futimens(tgtfd, times));
+        if (ret < 0) {
+            fsops_fail("Set target times");
+            goto cleanup;
+        }
+    }
+    stats_phase(&mark, STATS_TIMES, 0);
+
+    if (verify) {
+        verifying = false;
+        ret = verify_finish(&v);
+        if (ret < 0) {
+            /* What was committed can't be trusted to carry on from */
+            discard = true;
+            goto cleanup;
+        }
+        stats_phase(&mark, STATS_VERIFY, 0);
+    }
+
+    if (durability == DURABILITY_FILE) {
+        ret = STATS_SYSCALL(fsync(tgtfd));
+        if (ret < 0) {
+            fsops_fail("Sync target file");
+            goto cleanup;
+        }
+        stats_phase(&mark, STATS_SYNC, 0);
+    }
+
+    if (tmppath == NULL) {
+        ret = link_tmpfile(tgtfd, target, clobber);
+    } else {
+        ret = dirfd = open_target_dir(target, &name);
+        if (dirfd >= 0)
+            ret = rename_file(dirfd, tmppath, dirfd, name, clobber);
+        if (ret < 0)
+            fsops_fail("Rename temporary target file");
+    }
+    if (ret == 0)
+        stats_phase(&mark, STATS_COMMIT, 0);
+    if (ret == 0 && resume)
+        (void)STATS_SYSCALL(unlinkat(dirfd, rs.journal, 0));
+cleanup:
+    /* The read backs use the files, so have to finish first */
+    if (verifying)
+        verify_wait(&v);
+    close(srcfd);
+    close(tgtfd);
+    /* A failed resumable copy is kept for the next attempt to carry on,
+       unless it failed verification */
+    if (tmppath && ret != 0 && (!resume || discard)
+        && (dirfd = open_target_dir(target, &name)) >= 0) {
+        (void)STATS_SYSCALL(unlinkat(dirfd, tmppath, 0));
+        if (resume)
+            (void)STATS_SYSCALL(unlinkat(dirfd, rs.journal, 0));
+    }
+    if (rs.journalfd >= 0)
+        close(rs.journalfd);
+    free(rs.journal);
+    free(tmppath);
+    return ret;
+}
+
+static char *join_path(const char *dir, const char *name) {
+    char *path = malloc(strlen(dir) + strlen(name) + 2);
+    if (path == NULL)
+        return NULL;
+    strcpy(path, dir);
+    strcat(path, "/");
+    strcat(path, name);
+    return path;
+}
+
+/* Recreate a symlink, device node, fifo or socket at target,
+   which must not exist yet. */
+static int create_special(const char *source, const char *target,
+                          struct stat *source_stat, enum setgid setgid) {
+    const char *name;
+    int dirfd;
+    int tgtfd = -1;
+    int ret = -1;
+
+    ret = set_selinux_create_context(target, source_stat->st_mode);
+    if (ret != 0) {
+        fsops_fail("Set selinux create context");
+        goto cleanup;
+    }
+
+    ret = dirfd = open_target_dir(target, &name);
+    if (ret < 0) {
+        fsops_fail("Open target directory");
+        goto cleanup;
+    }
+
+    if (S_ISLNK(source_stat->st_mode)) {
+        char linkname[PATH_MAX];
+        ssize_t len = STATS_SYSCALL(readlink(source, linkname,
+                                             sizeof(linkname)));
+        if (len < 0) {
+            fsops_fail("Read source symlink");
+            ret = -1;
+            goto cleanup;
+        }
+        if (len == sizeof(linkname)) {
+            errno = ENAMETOOLONG;
+            fsops_fail("Read source symlink");
+            ret = -1;
+            goto cleanup;
+        }
+        linkname[len] = '\0';
+
+        ret = STATS_SYSCALL(symlinkat(linkname, dirfd, name));
+        if (ret < 0) {
+            fsops_fail("Create target symlink");
+            goto cleanup;
+        }
+    } else {
+        ret = STATS_SYSCALL(mknodat(dirfd, name, source_stat->st_mode,
+                                    source_stat->st_rdev));
+        if (ret < 0) {
+            fsops_fail("Create target node");
+            goto cleanup;
+        }
+
+        /* mknod's mode was filtered through the umask */
+        ret = STATS_SYSCALL(fchmodat(dirfd, name, source_stat->st_mode, 0));
+        if (ret < 0)
+            goto cleanup;
+    }
+
+    ret = STATS_SYSCALL(openat(dirfd, name, O_PATH|O_NOFOLLOW));
+    if (ret == -1) {
+        fsops_fail("Open target node");
+        goto cleanup;
+    }
+    tgtfd = ret;
+
+    ret = fix_owner(target, source_stat, setgid, tgtfd, NULL);
+    if (ret < 0)
+        goto cleanup;
+
+    {
+        struct timespec times[] = { source_stat->st_atim, source_stat->st_mtim, };
+        ret = STATS_SYSCALL(utimensat(dirfd, name, times,
+                                      AT_SYMLINK_NOFOLLOW));
+        if (ret < 0)
+            goto cleanup;
+    }
+
+cleanup:
+    if (tgtfd >= 0)
+        close(tgtfd);
+    return ret;
+}
+
+/* Copy a non-regular, non-directory file to target,
+   creating it in a private directory so it can be renamed into place. */
+static int copy_special(const char *source, const char *target,
+                        struct stat *source_stat,
+                        const struct move_opts *opts) {
+    struct stats_mark mark;
+    char *staging = NULL;
+    char *tmppath = NULL;
+    const char *name;
+    int ret = -1;
+
+    staging = tmp_template(target);
+    if (staging == NULL)
+        goto cleanup;
+    if (STATS_SYSCALL(mkdtemp(staging)) == NULL) {
+        fsops_fail("Make staging directory");
+        free(staging);
+        staging = NULL;
+        goto cleanup;
+    }
+
+    tmppath = join_path(staging, "node");
+    if (tmppath == NULL)
+        goto cleanup;
+
+    stats_start(&mark);
+    ret = create_special(source, tmppath, source_stat, opts->setgid);
+    if (ret < 0)
+        goto cleanup;
+    stats_phase(&mark, STATS_SPECIAL, 0);
+
+    ret = open_target_dir(target, &name);
+    if (ret < 0) {
+        fsops_fail("Open target directory");
+        goto cleanup;
+    }
+    ret = rename_file(AT_FDCWD, tmppath, ret, name, opts->clobber);
+    if (ret == 0)
+        stats_phase(&mark, STATS_COMMIT, 0);
+
+cleanup:
+    if (staging)
+        (void)remove_tree_at(AT_FDCWD, staging);
+    free(tmppath);
+    free(staging);
+    return ret;
+}
+
+/* Apply the metadata of directory source to target,
+   once everything inside it has been created. */
+static int finish_dir(const char *source, const char *target,
+                      struct file_meta *source_meta, enum setgid setgid,
+                      int required_flags, bool sync) {
+    struct stat *source_stat = &source_meta->st;
+    struct file_meta target_meta;
+    const char *name;
+    int srcfd = -1;
+    int tgtfd = -1;
+    int ret = -1;
+
+    ret = STATS_SYSCALL(open(source, O_RDONLY|O_DIRECTORY|O_NOFOLLOW));
+    if (ret == -1) {
+        fsops_fail("Open source directory");
+        goto cleanup;
+    }
+    srcfd = ret;
+
+    ret = open_target_dir(target, &name);
+    if (ret >= 0)
+        ret = STATS_SYSCALL(openat(ret, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW));
+    if (ret == -1) {
+        fsops_fail("Open target directory");
+        goto cleanup;
+    }
+    tgtfd = ret;
+
+    ret = file_meta_fd(tgtfd, &target_meta);
+    if (ret < 0) {
+        fsops_fail("Stat target directory");
+        goto cleanup;
+    }
+
+    ret = STATS_SYSCALL(fchmod(tgtfd, source_stat->st_mode));
+    if (ret < 0) {
+        fsops_fail("Chmod target");
+        goto cleanup;
+    }
+
+    ret = fix_owner(target, source_stat, setgid, tgtfd, &target_meta.st);
+    if (ret < 0)
+        goto cleanup;
+
+    ret = copy_flags(srcfd, source_meta, tgtfd, &target_meta, required_flags);
+    if (ret < 0) {
+        fsops_fail("Copy inode flags");
+        goto cleanup;
+    }
+
+    ret = copy_xattrs(srcfd, tgtfd);
+    if (ret < 0) {
+        fsops_fail("Copy xattrs");
+        goto cleanup;
+    }
+
+    ret = copy_posix_acls(srcfd, tgtfd, source_stat->st_mode);
+    if (ret < 0) {
+        fsops_fail("Copy POSIX ACLs");
+        goto cleanup;
+    }
+
+    {
+        struct timespec times[] = { source_stat->st_atim, source_stat->st_mtim, };
+        ret = STATS_SYSCALL(futimens(tgtfd, times));
+        if (ret < 0) {
+            fsops_fail("Set target times");
+            goto cleanup;
+        }
+    }
+
+    /* Its entries, which are all made by now */
+    if (sync) {
+        ret = STATS_SYSCALL(fsync(tgtfd));
+        if (ret < 0)
+            fsops_fail("Sync target directory");
+    }
+
+cleanup:
+    if (srcfd >= 0)
+        close(srcfd);
+    if (tgtfd >= 0)
+        close(tgtfd);
+    return ret;
+}
+
+/* Non-directories with more than one link are copied once per tree,
+   and their other names in it are made as hard links to that copy.
+   An inode is forgotten once all of its links have been seen,
+   so only inodes partly seen so far are remembered. */
+#define INODE_MAP_BUCKETS 1024
+
+struct tree_move {
+    const struct move_opts *opts;
+    unsigned long outstanding;   /* 1 until the root directory is finished */
+    int error;                   /* errno of the first failure */
+    const char *what;            /* and what was being done */
+    pthread_mutex_t inodes_lock;
+    struct inode_link *inodes[INODE_MAP_BUCKETS];
+};
+
+/* A directory being copied by move_tree.
+   pending counts the entries of the directory still being copied,
+   plus one for the scan of the directory itself.
+   Whoever drops it to zero applies the directory's metadata
+   and then drops its own count from the parent,
+   so directories are finished bottom-up. */
+struct tree_dir {
+    struct tree_move *tm;
+    struct tree_dir *parent;
+    char *source;
+    char *target;
+    struct file_meta source_meta;
+    unsigned long pending;
+};
+
+struct tree_entry {
+    struct tree_dir *dir;
+    char *source;
+    char *target;
+    struct file_meta source_meta;
+    struct tree_entry *next;     /* in its inode_link's waiting list */
+};
+
+struct inode_link {
+    struct inode_link *next;
+    dev_t dev;
+    ino_t ino;
+    nlink_t unseen;              /* links not yet found in the tree */
+    char *target;                /* first copy, NULL until it is complete */
+    bool failed;                 /* first copy couldn't be recorded */
+    struct tree_entry *waiting;  /* names found while it was being copied */
+};
+
+static void tree_fail(struct tree_move *tm) {
+    int expected = 0;
+    int err = errno ? errno : EIO;
+    /* Only read by the caller of move_tree once the workers are done */
+    if (__atomic_compare_exchange_n(&tm->error, &expected, err, false,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        tm->what = fsops_last_error()->what;
+}
+
+static bool tree_failed(struct tree_move *tm) {
+    return __atomic_load_n(&tm->error, __ATOMIC_SEQ_CST) != 0;
+}
+
+static void tree_dir_free(struct tree_dir *dir) {
+    free(dir->source);
+    free(dir->target);
+    free(dir);
+}
+
+static void tree_dir_release(struct tree_dir *dir) {
+    while (dir != NULL
+           && __atomic_sub_fetch(&dir->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+        struct tree_dir *parent = dir->parent;
+        struct tree_move *tm = dir->tm;
+        struct stats_mark mark;
+
+        stats_start(&mark);
+        if (!tree_failed(tm)
+            && finish_dir(dir->source, dir->target, &dir->source_meta,
+                          tm->opts->setgid, tm->opts->required_flags,
+                          tm->opts->durability == DURABILITY_FILE) < 0)
+            tree_fail(tm);
+        stats_phase(&mark, STATS_DIR, 0);
+
+        tree_dir_free(dir);
+        /* The last use of tm, since move_tree may return once it's done */
+        if (parent == NULL)
+            pool_done(tm->opts->copy.pool, &tm->outstanding);
+        dir = parent;
+    }
+}
+
+static void tree_entry_release(struct tree_entry *entry) {
+    struct tree_dir *dir = entry->dir;
+    free(entry->source);
+    free(entry->target);
+    free(entry);
+    tree_dir_release(dir);
+}
+
+static size_t inode_map_hash(dev_t dev, ino_t ino) {
+    return (ino ^ (dev * 2654435761u)) % INODE_MAP_BUCKETS;
+}
+
+/* Unlink link from the map, with inodes_lock held. */
+static void inode_map_remove(struct tree_move *tm, struct inode_link *link) {
+    struct inode_link **p = &tm->inodes[inode_map_hash(link->dev, link->ino)];
+    while (*p != link)
+        p = &(*p)->next;
+    *p = link->next;
+}
+
+static void inode_map_free(struct tree_move *tm) {
+    for (size_t i = 0; i < INODE_MAP_BUCKETS; i++) {
+        while (tm->inodes[i] != NULL) {
+            struct inode_link *link = tm->inodes[i];
+            tm->inodes[i] = link->next;
+            free(link->target);
+            free(link);
+        }
+    }
+}
+
+/* Find how to make entry, which has more than one link.
+   Returns 0 with *link_out set if entry is the first name of its inode,
+   to be copied and passed to inode_map_commit,
+   or with *linkto set to a path to hard link it to,
+   or with neither set if it should just be copied.
+   Returns 1 if the first name is still being copied,
+   in which case entry is linked and released by inode_map_commit. */
+static int inode_map_claim(struct tree_move *tm, struct tree_entry *entry,
+                           struct inode_link **link_out, char **linkto) {
+    const struct stat *st = &entry->source_meta.st;
+    size_t bucket = inode_map_hash(st->st_dev, st->st_ino);
+    struct inode_link *link;
+    int ret = 0;
+
+    pthread_mutex_lock(&tm->inodes_lock);
+    for (link = tm->inodes[bucket]; link != NULL; link = link->next) {
+        if (link->dev == st->st_dev && link->ino == st->st_ino)
+            break;
+    }
+
+    if (link == NULL) {
+        /* Failing to remember it only costs copying the other names */
+        link = calloc(1, sizeof *link);
+        if (link != NULL) {
+            link->dev = st->st_dev;
+            link->ino = st->st_ino;
+            link->unseen = st->st_nlink - 1;
+            link->next = tm->inodes[bucket];
+            tm->inodes[bucket] = link;
+            *link_out = link;
+        }
+        goto cleanup;
+    }
+
+    /* Links may have been added since it was first seen */
+    if (link->unseen > 0)
+        link->unseen--;
+
+    if (link->target == NULL && !link->failed) {
+        entry->next = link->waiting;
+        link->waiting = entry;
+        ret = 1;
+        goto cleanup;
+    }
+
+    if (!link->failed)
+        *linkto = strdup(link->target);
+    if (link->unseen == 0) {
+        inode_map_remove(tm, link);
+        free(link->target);
+        free(link);
+    }
+
+cleanup:
+    pthread_mutex_unlock(&tm->inodes_lock);
+    return ret;
+}
+
+/* Record the first copy of link's inode as made at target,
+   or NULL if it couldn't be, and make the names that were waiting on it. */
+static void inode_map_commit(struct tree_move *tm, struct inode_link *link,
+                             const char *target) {
+    struct tree_entry *waiting;
+    bool done;
+
+    pthread_mutex_lock(&tm->inodes_lock);
+    if (target != NULL)
+        link->target = strdup(target);
+    /* Later names are copied instead if the path can't be kept */
+    link->failed = link->target == NULL;
+    waiting = link->waiting;
+    link->waiting = NULL;
+    done = link->unseen == 0;
+    if (done)
+        inode_map_remove(tm, link);
+    pthread_mutex_unlock(&tm->inodes_lock);
+
+    while (waiting != NULL) {
+        struct tree_entry *entry = waiting;
+        struct stats_mark mark;
+        waiting = entry->next;
+        stats_start(&mark);
+        if (target != NULL && !tree_failed(tm)
+            && STATS_SYSCALL(linkat(AT_FDCWD, target, AT_FDCWD,
+                                    entry->target, 0)) < 0) {
+            fsops_fail("Link to copied file");
+            tree_fail(tm);
+        }
+        stats_phase(&mark, STATS_HARDLINK, 0);
+        tree_entry_release(entry);
+    }
+
+    if (done) {
+        free(link->target);
+        free(link);
+    }
+}
+
+static void tree_copy_entry(struct pool *pool, void *arg) {
+    struct tree_entry *entry = arg;
+    struct tree_move *tm = entry->dir->tm;
+    const struct move_opts *opts = tm->opts;
+    struct inode_link *link = NULL;
+    struct stats_mark mark;
+    char *linkto = NULL;
+    int ret;
+
+    fsops_clear_error();
+    if (tree_failed(tm))
+        goto done;
+
+    if (entry->source_meta.st.st_nlink > 1
+        && inode_map_claim(tm, entry, &link, &linkto) > 0)
+        return;
+
+    stats_start(&mark);
+    if (linkto != NULL) {
+        ret = STATS_SYSCALL(linkat(AT_FDCWD, linkto, AT_FDCWD, entry->target,
+                                   0));
+        if (ret < 0)
+            fsops_fail("Link to copied file");
+        free(linkto);
+        stats_phase(&mark, STATS_HARDLINK, 0);
+    } else if (S_ISREG(entry->source_meta.st.st_mode)) {
+        if (entry->source_meta.st.st_nlink > 1)
+            progress_expect(entry->source_meta.st.st_size);
+        /* Nothing else can be in the staging tree, so no need to clobber */
+        ret = copy_file(entry->source, entry->target, &entry->source_meta,
+                        CLOBBER_PERMITTED, opts->setgid,
+                        opts->required_flags, &opts->copy, false,
+                        opts->verify, opts->durability);
+    } else {
+        ret = create_special(entry->source, entry->target,
+                             &entry->source_meta.st, opts->setgid);
+        stats_phase(&mark, STATS_SPECIAL, 0);
+    }
+    if (ret != 0)
+        tree_fail(tm);
+    if (link != NULL)
+        inode_map_commit(tm, link, ret == 0 ? entry->target : NULL);
+
+done:
+    tree_entry_release(entry);
+}
+
+static void tree_scan_dir(struct pool *pool, void *arg);
+
+static int tree_add_entry(struct pool *pool, struct tree_dir *dir,
+                          int dirfd, const char *name) {
+    struct file_meta meta;
+    const struct stat *st = &meta.st;
+    char *source = NULL;
+    char *target = NULL;
+    int ret = -1;
+
+    ret = file_meta_at(dirfd, name, AT_SYMLINK_NOFOLLOW, &meta);
+    if (ret < 0) {
+        fsops_fail("Stat source entry");
+        return ret;
+    }
+
+    ret = -1;
+    source = join_path(dir->source, name);
+    target = join_path(dir->target, name);
+    if (source == NULL || target == NULL)
+        goto error;
+
+    __atomic_add_fetch(&dir->pending, 1, __ATOMIC_SEQ_CST);
+    if (S_ISDIR(st->st_mode)) {
+        struct tree_dir *child = calloc(1, sizeof *child);
+        if (child == NULL)
+            goto error_pending;
+        child->tm = dir->tm;
+        child->parent = dir;
+        child->source = source;
+        child->target = target;
+        child->source_meta = meta;
+        child->pending = 1;
+
+        ret = pool_submit(pool, tree_scan_dir, child);
+        if (ret < 0) {
+            free(child);
+            goto error_pending;
+        }
+    } else {
+        struct tree_entry *entry = calloc(1, sizeof *entry);
+        if (entry == NULL)
+            goto error_pending;
+        /* Further links of an inode are only counted if they're copied */
+        if (S_ISREG(st->st_mode) && st->st_nlink == 1)
+            progress_expect(st->st_size);
+        entry->dir = dir;
+        entry->source = source;
+        entry->target = target;
+        entry->source_meta = meta;
+
+        ret = pool_submit(pool, tree_copy_entry, entry);
+        if (ret < 0) {
+            free(entry);
+            goto error_pending;
+        }
+    }
+    return 0;
+
+error_pending:
+    /* Can't reach zero, our scan still holds a count */
+    __atomic_sub_fetch(&dir->pending, 1, __ATOMIC_SEQ_CST);
+error:
+    free(source);
+    free(target);
+    return -1;
+}
+
+static void tree_scan_dir(struct pool *pool, void *arg) {
+    struct tree_dir *dir = arg;
+    struct tree_move *tm = dir->tm;
+    struct stats_mark mark;
+    DIR *srcdir = NULL;
+    int ret;
+
+    fsops_clear_error();
+    if (tree_failed(tm))
+        goto done;
+
+    /* The root was already made as the staging directory */
+    stats_start(&mark);
+    if (dir->parent != NULL) {
+        ret = set_selinux_create_context(dir->target,
+                                         dir->source_meta.st.st_mode);
+        if (ret != 0) {
+            fsops_fail("Set selinux create context");
+            goto error;
+        }
+
+        /* Only we need access until finish_dir applies the real mode */
+        ret = STATS_SYSCALL(mkdir(dir->target, S_IRWXU));
+        if (ret < 0) {
+            fsops_fail("Make target directory");
+            goto error;
+        }
+        stats_phase(&mark, STATS_DIR, 0);
+    }
+
+    srcdir = opendir(dir->source);
+    if (srcdir == NULL) {
+        fsops_fail("Open source directory");
+        goto error;
+    }
+
+    for (;;) {
+        struct dirent *ent;
+        errno = 0;
+        ent = readdir(srcdir);
+        if (ent == NULL) {
+            if (errno != 0) {
+                fsops_fail("Read source directory");
+                goto error;
+            }
+            break;
+        }
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+        if (tree_failed(tm))
+            break;
+
+        ret = tree_add_entry(pool, dir, dirfd(srcdir), ent->d_name);
+        if (ret < 0)
+            goto error;
+    }
+    goto done;
+
+error:
+    tree_fail(tm);
+done:
+    if (srcdir != NULL)
+        closedir(srcdir);
+    tree_dir_release(dir);
+}
+
+/* Tree copies share the workers with the chunks of the large files in them,
+   and with any other moves running at the same time. */
+static struct pool *get_copy_pool(struct move_opts *opts) {
+    if (opts->copy.pool == NULL)
+        opts->copy.pool = fsops_pool(opts->jobs);
+    return opts->copy.pool;
+}
+
+/* Removing a source tree once its copy has been renamed into place.
+   Each directory is read in large batches with getdents64,
+   its other entries are unlinked relative to its fd as they are read,
+   and its subdirectories are handed to the workers.
+   pending counts the subdirectories still being removed,
+   plus one for the scan of the directory itself.
+   Whoever drops it to zero removes the directory from its parent,
+   so directories are removed bottom-up. */
+#define DIRENTS_SIZE (256 * 1024)
+
+/* As getdents64 lays out each entry */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct tree_remove {
+    struct pool *pool;
+    unsigned long outstanding;   /* 1 until the root directory is removed */
+    int error;                   /* errno of the first failure */
+    const char *what;            /* and what was being done */
+};
+
+struct remove_dir {
+    struct tree_remove *tr;
+    struct remove_dir *parent;
+    int fd;                      /* kept open for its subdirectories */
+    unsigned long pending;
+    char name[];                 /* in parent, or the path of the root */
+};
+
+/* Each worker reads directories into its own buffer,
+   freed by dirents_key when the thread exits */
+static pthread_key_t dirents_key;
+static pthread_once_t dirents_key_once = PTHREAD_ONCE_INIT;
+static __thread char *dirents;
+
+static void make_dirents_key(void) {
+    (void)pthread_key_create(&dirents_key, free);
+}
+
+static void remove_fail(struct tree_remove *tr, const char *what) {
+    int expected = 0;
+    int err = errno ? errno : EIO;
+    /* Only read by the caller of remove_tree once the workers are done */
+    if (__atomic_compare_exchange_n(&tr->error, &expected, err, false,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        tr->what = what;
+}
+
+static bool remove_failed(struct tree_remove *tr) {
+    return __atomic_load_n(&tr->error, __ATOMIC_SEQ_CST) != 0;
+}
+
+static void remove_dir_release(struct remove_dir *dir) {
+    while (dir != NULL
+           && __atomic_sub_fetch(&dir->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+        struct remove_dir *parent = dir->parent;
+        struct tree_remove *tr = dir->tr;
+        struct stats_mark mark;
+
+        stats_start(&mark);
+        if (dir->fd >= 0)
+            close(dir->fd);
+        if (!remove_failed(tr)
+            && STATS_SYSCALL(unlinkat(parent ? parent->fd : AT_FDCWD,
+                                      dir->name, AT_REMOVEDIR)) < 0)
+            remove_fail(tr, "Remove source directory");
+        stats_phase(&mark, STATS_REMOVE, 0);
+
+        free(dir);
+        /* The last use of tr, since remove_tree may return once it's done */
+        if (parent == NULL)
+            pool_done(tr->pool, &tr->outstanding);
+        dir = parent;
+    }
+}
+
+static void remove_scan_dir(struct pool *pool, void *arg);
+
+static int remove_add_dir(struct pool *pool, struct remove_dir *dir,
+                          const char *name) {
+    size_t len = strlen(name) + 1;
+    struct remove_dir *child = malloc(sizeof *child + len);
+    int ret;
+
+    if (child == NULL)
+        return -1;
+    child->tr = dir->tr;
+    child->parent = dir;
+    child->fd = -1;
+    child->pending = 1;
+    memcpy(child->name, name, len);
+
+    __atomic_add_fetch(&dir->pending, 1, __ATOMIC_SEQ_CST);
+    ret = pool_submit(pool, remove_scan_dir, child);
+    if (ret < 0) {
+        /* Can't reach zero, our scan still holds a count */
+        __atomic_sub_fetch(&dir->pending, 1, __ATOMIC_SEQ_CST);
+        free(child);
+    }
+    return ret;
+}
+
+static void remove_scan_dir(struct pool *pool, void *arg) {
+    struct remove_dir *dir = arg;
+    struct tree_remove *tr = dir->tr;
+    struct stats_mark mark;
+    const char *what = NULL;
+
+    stats_start(&mark);
+    if (remove_failed(tr))
+        goto done;
+
+    dir->fd = STATS_SYSCALL(openat(dir->parent ? dir->parent->fd : AT_FDCWD,
+                                   dir->name,
+                                   O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC));
+    if (dir->fd < 0) {
+        what = "Open source directory";
+        goto error;
+    }
+
+    if (dirents == NULL) {
+        pthread_once(&dirents_key_once, make_dirents_key);
+        dirents = malloc(DIRENTS_SIZE);
+        if (dirents == NULL) {
+            what = "Allocate directory buffer";
+            goto error;
+        }
+        (void)pthread_setspecific(dirents_key, dirents);
+    }
+
+    for (;;) {
+        long len = STATS_SYSCALL(syscall(SYS_getdents64, dir->fd, dirents,
+                                         DIRENTS_SIZE));
+        if (len < 0) {
+            what = "Read source directory";
+            goto error;
+        }
+        if (len == 0)
+            break;
+
+        for (long off = 0; off < len;) {
+            struct linux_dirent64 *ent = (void *)(dirents + off);
+            off += ent->d_reclen;
+            if (strcmp(ent->d_name, ".") == 0
+                || strcmp(ent->d_name, "..") == 0)
+                continue;
+
+            /* Filesystems that don't report types say so with EISDIR */
+            if (ent->d_type != DT_DIR) {
+                if (STATS_SYSCALL(unlinkat(dir->fd, ent->d_name, 0)) == 0)
+                    continue;
+                if (errno != EISDIR || ent->d_type != DT_UNKNOWN) {
+                    what = "Remove source entry";
+                    goto error;
+                }
+            }
+
+            if (remove_add_dir(pool, dir, ent->d_name) < 0) {
+                what = "Queue source directory removal";
+                goto error;
+            }
+        }
+        if (remove_failed(tr))
+            break;
+    }
+    goto done;
+
+error:
+    remove_fail(tr, what);
+done:
+    stats_phase(&mark, STATS_REMOVE, 0);
+    remove_dir_release(dir);
+}
+
+/* Remove the directory tree at path using the workers.
+   Unlike remove_tree_at, path must be a directory. */
+static int remove_tree(struct pool *pool, const char *path) {
+    struct tree_remove tr = {
+        .pool = pool,
+        .outstanding = 1,
+    };
+    size_t len = strlen(path) + 1;
+    struct remove_dir *root = malloc(sizeof *root + len);
+    int ret;
+
+    if (root == NULL)
+        return -1;
+    root->tr = &tr;
+    root->parent = NULL;
+    root->fd = -1;
+    root->pending = 1;
+    memcpy(root->name, path, len);
+
+    ret = pool_submit(pool, remove_scan_dir, root);
+    if (ret < 0) {
+        free(root);
+        return ret;
+    }
+    pool_wait_for(pool, &tr.outstanding);
+
+    if (tr.error != 0) {
+        errno = tr.error;
+        fsops_fail(tr.what);
+        return -1;
+    }
+    return 0;
+}
+
+/* Copy the directory tree at source into a staging directory next to target
+   using a pool of workers, then rename it into place once it is complete. */
+static int move_tree(const char *source, const char *target,
+                     struct file_meta *source_meta, struct move_opts *opts) {
+    struct tree_move tm = {
+        .opts = opts,
+        .outstanding = 1,
+        .inodes_lock = PTHREAD_MUTEX_INITIALIZER,
+    };
+    struct tree_dir *root = NULL;
+    char *staging = NULL;
+    const char *name;
+    int ret = -1;
+
+    ret = set_selinux_create_context(target, source_meta->st.st_mode);
+    if (ret != 0) {
+        fsops_fail("Set selinux create context");
+        return ret;
+    }
+
+    ret = -1;
+    staging = tmp_template(target);
+    if (staging == NULL)
+        return ret;
+    if (STATS_SYSCALL(mkdtemp(staging)) == NULL) {
+        fsops_fail("Make staging directory");
+        free(staging);
+        return ret;
+    }
+
+    root = calloc(1, sizeof *root);
+    if (root == NULL)
+        goto cleanup;
+    root->tm = &tm;
+    root->source = strdup(source);
+    root->target = strdup(staging);
+    root->source_meta = *source_meta;
+    root->pending = 1;
+    if (root->source == NULL || root->target == NULL) {
+        tree_dir_free(root);
+        goto cleanup;
+    }
+
+    if (get_copy_pool(opts) == NULL) {
+        fsops_fail("Start copy workers");
+        tree_dir_free(root);
+        goto cleanup;
+    }
+
+    ret = pool_submit(opts->copy.pool, tree_scan_dir, root);
+    if (ret < 0) {
+        tree_dir_free(root);
+        goto cleanup;
+    }
+    pool_wait_for(opts->copy.pool, &tm.outstanding);
+
+    if (tm.error != 0) {
+        errno = tm.error;
+        fsops_fail(tm.what != NULL ? tm.what : "Copy directory tree");
+        ret = -1;
+        goto cleanup;
+    }
+
+    ret = open_target_dir(target, &name);
+    if (ret < 0) {
+        fsops_fail("Open target directory");
+        goto cleanup;
+    }
+
+    /* One sync for the whole tree, which is all on the target's filesystem */
+    if (opts->durability == DURABILITY_BATCH) {
+        struct stats_mark mark;
+        stats_start(&mark);
+        ret = STATS_SYSCALL(syncfs(ret));
+        if (ret < 0) {
+            fsops_fail("Sync target filesystem");
+            goto cleanup;
+        }
+        stats_phase(&mark, STATS_SYNC, 0);
+        ret = open_target_dir(target, &name);
+    }
+
+    if (ret >= 0)
+        ret = rename_file(AT_FDCWD, staging, ret, name, opts->clobber);
+    if (ret != 0)
+        fsops_fail("Rename staging directory into place");
+
+cleanup:
+    if (ret != 0) {
+        int saved_errno = errno;
+        (void)remove_tree_at(AT_FDCWD, staging);
+        errno = saved_errno;
+    }
+    inode_map_free(&tm);
+    free(staging);
+    return ret;
+}
+
+/* Make the name of a committed target durable. */
+static int sync_target_dir(const char *target) {
+    struct stats_mark mark;
+    const char *name;
+    int ret;
+
+    stats_start(&mark);
+    ret = open_target_dir(target, &name);
+    if (ret >= 0)
+        ret = STATS_SYSCALL(fsync(ret));
+    if (ret < 0)
+        fsops_fail("Sync target directory");
+    stats_phase(&mark, STATS_SYNC, 0);
+    return ret;
+}
+
+/* Moves with DURABILITY_BATCH commit their copies straight away,
+   but leave their sources until the filesystems the copies are on
+   have been synced, which is done once for the whole batch. */
+#define BATCH_SOURCES 256
+#define BATCH_FILESYSTEMS 16
+
+struct batch_source {
+    char *path;
+    dev_t dev;                   /* only removed if it's still this file */
+    ino_t ino;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct batch_source sources[BATCH_SOURCES];
+    size_t nsources;
+    int fsfds[BATCH_FILESYSTEMS];   /* a directory on each filesystem */
+    dev_t fsdevs[BATCH_FILESYSTEMS];
+    size_t nfs;
+    struct fsops_error error;    /* first failure finishing a full batch,
+                                    left for fsops_flush to report */
+} batch = { .lock = PTHREAD_MUTEX_INITIALIZER, };
+
+/* Sync the batch's filesystems, then remove its sources, with lock held.
+   If a sync fails, its sources are left alone since their copies may not
+   have survived a crash, and so are the rest, as there's no telling
+   which filesystem each of them was copied to. */
+static int batch_flush_locked(void) {
+    struct stats_mark mark;
+    bool synced = true;
+    int ret = 0;
+
+    if (batch.nfs == 0 && batch.nsources == 0)
+        return 0;
+
+    stats_start(&mark);
+    for (size_t i = 0; i < batch.nfs; i++) {
+        if (synced && STATS_SYSCALL(syncfs(batch.fsfds[i])) < 0) {
+            fsops_fail("Sync target filesystem");
+            synced = false;
+            ret = -1;
+        }
+        close(batch.fsfds[i]);
+    }
+    batch.nfs = 0;
+    stats_phase(&mark, STATS_SYNC, 0);
+
+    for (size_t i = 0; i < batch.nsources; i++) {
+        struct batch_source *src = &batch.sources[i];
+        struct stat st;
+
+        /* Something else may have been put there since */
+        if (synced && STATS_SYSCALL(lstat(src->path, &st)) == 0
+            && st.st_dev == src->dev && st.st_ino == src->ino
+            && STATS_SYSCALL(unlink(src->path)) < 0) {
+            fsops_fail("Remove source");
+            ret = -1;
+        }
+        free(src->path);
+    }
+    batch.nsources = 0;
+    stats_phase(&mark, STATS_REMOVE, 0);
+    return ret;
+}
+
+/* Finish a full batch for the move that filled it, keeping any failure
+   for fsops_flush, since it's a failure of the earlier moves' sources
+   and not of this move. */
+static void batch_flush_full_locked(void) {
+    if (batch_flush_locked() < 0 && batch.error.what == NULL)
+        batch.error = *fsops_last_error();
+    fsops_clear_error();
+}
+
+/* Leave source to be removed once the batch its copy at target is in
+   has been synced, which may be now if that fills the batch. */
+static int batch_add(const char *source, const struct stat *source_stat,
+                     const char *target) {
+    const char *name;
+    char *path = NULL;
+    size_t fs;
+    int ret = -1;
+
+    ret = open_target_dir(target, &name);
+    if (ret < 0) {
+        fsops_fail("Open target directory");
+        return ret;
+    }
+    path = strdup(source);
+    if (path == NULL) {
+        fsops_fail("Remember source");
+        return -1;
+    }
+
+    pthread_mutex_lock(&batch.lock);
+    for (fs = 0; fs < batch.nfs; fs++) {
+        if (batch.fsdevs[fs] == target_dir.st.st_dev)
+            break;
+    }
+    if (fs == batch.nfs) {
+        if (batch.nfs == BATCH_FILESYSTEMS) {
+            batch_flush_full_locked();
+            fs = 0;
+        }
+        ret = STATS_SYSCALL(fcntl(target_dir.fd, F_DUPFD_CLOEXEC, 0));
+        if (ret < 0) {
+            fsops_fail("Keep target filesystem open");
+            goto cleanup;
+        }
+        batch.fsfds[fs] = ret;
+        batch.fsdevs[fs] = target_dir.st.st_dev;
+        batch.nfs++;
+    }
+
+    batch.sources[batch.nsources++] = (struct batch_source){
+        .path = path,
+        .dev = source_stat->st_dev,
+        .ino = source_stat->st_ino,
+    };
+    path = NULL;
+    ret = 0;
+    if (batch.nsources == BATCH_SOURCES)
+        batch_flush_full_locked();
+cleanup:
+    pthread_mutex_unlock(&batch.lock);
+    free(path);
+    return ret;
+}
+
+int fsops_flush(void) {
+    int ret;
+
+    fsops_clear_error();
+    pthread_mutex_lock(&batch.lock);
+    if (batch.error.what != NULL) {
+        errno = batch.error.err;
+        fsops_fail(batch.error.what);
+        batch.error.what = NULL;
+    }
+    ret = batch_flush_locked();
+    if (fsops_last_error()->what != NULL)
+        ret = -1;
+    pthread_mutex_unlock(&batch.lock);
+    return ret;
+}
+
+static int move_file(const char *source, const char *target,
+                     struct move_opts *opts) {
+    int ret;
+    struct file_meta source_meta;
+    struct stat *source_stat = &source_meta.st;
+    struct stats_mark mark;
+    bool have_source_stat = false;
+    const char *name;
+    int tgtdirfd;
+
+    stats_start(&mark);
+    if (opts->setgid == SETGID_NEVER) {
+        ret = file_meta_at(AT_FDCWD, source, AT_SYMLINK_NOFOLLOW,
+                           &source_meta);
+        if (ret < 0)
+            return ret;
+        have_source_stat = true;
+    }
+
+    tgtdirfd = open_target_dir(target, &name);
+    if (tgtdirfd < 0) {
+        fsops_fail("Open target directory");
+        return tgtdirfd;
+    }
+
+    ret = rename_file(AT_FDCWD, source, tgtdirfd, name, opts->clobber);
+    if (ret == 0) {
+        ret = fix_rename_owner(target, source_stat, opts->setgid);
+        stats_phase(&mark, STATS_RENAME, 0);
+        return ret;
+    }
+    if (errno == EXDEV)
+        goto xdev;
+    if (errno != ENOSYS) {
+        fsops_fail("rename2");
+        return ret;
+    }
+    /* Have to skip to copy if unimplemented since rename can't detect EEXIST */
+    if (opts->clobber == CLOBBER_FORBIDDEN)
+        goto xdev;
+rename:
+    ret = STATS_SYSCALL(renameat(AT_FDCWD, source, tgtdirfd, name));
+    if (ret == 0) {
+        ret = fix_rename_owner(target, source_stat, opts->setgid);
+        stats_phase(&mark, STATS_RENAME, 0);
+        return ret;
+    }
+    if (errno == EXDEV)
+        goto xdev;
+    fsops_fail("rename");
+    return ret;
+xdev:
+    if (!have_source_stat) {
+        ret = file_meta_at(AT_FDCWD, source, AT_SYMLINK_NOFOLLOW,
+                           &source_meta);
+        if (ret < 0)
+            return ret;
+    }
+
+    if (S_ISDIR(source_stat->st_mode)) {
+        ret = move_tree(source, target, &source_meta, opts);
+        if (ret != 0)
+            return ret;
+        /* Only remove the source once the whole copy has been renamed in,
+           since until then the staging tree may yet be thrown away */
+        if (opts->durability != DURABILITY_NONE
+            && sync_target_dir(target) < 0)
+            return -1;
+        return remove_tree(opts->copy.pool, source);
+    }
+
+    /* A single large file is copied in chunks by the workers,
+       and they read back a verified copy while the metadata is copied,
+       but it's all fine done on this thread if they can't be started. */
+    if (S_ISREG(source_stat->st_mode) && opts->jobs != 1
+        && ((opts->copy.chunk_size != 0
+             && source_stat->st_size > opts->copy.chunk_size)
+            || opts->verify))
+        (void)get_copy_pool(opts);
+
+    if (S_ISREG(source_stat->st_mode)) {
+        progress_expect(source_stat->st_size);
+        ret = copy_file(source, target, &source_meta, opts->clobber,
+                        opts->setgid, opts->required_flags, &opts->copy,
+                        opts->resume, opts->verify, opts->durability);
+    } else {
+        ret = copy_special(source, target, source_stat, opts);
+    }
+    if (ret != 0)
+        return ret;
+    if (opts->durability == DURABILITY_BATCH)
+        return batch_add(source, source_stat, target);
+    if (opts->durability == DURABILITY_FILE && sync_target_dir(target) < 0)
+        return -1;
+    stats_start(&mark);
+    ret = STATS_SYSCALL(unlink(source));
+    if (ret < 0)
+        fsops_fail("unlink");
+    stats_phase(&mark, STATS_REMOVE, 0);
+    return ret;
+}
+
+int fsops_move(const char *source, const char *target,
+               const struct fsops_opts *opts) {
+    struct fsops_opts defaults;
+    struct move_opts move_opts;
+    int ret;
+
+    fsops_clear_error();
+    __atomic_add_fetch(&target_dir_generation, 1, __ATOMIC_SEQ_CST);
+    if (opts == NULL) {
+        fsops_opts_init(&defaults);
+        opts = &defaults;
+    }
+    move_opts = (struct move_opts){
+        .clobber = opts->clobber,
+        .setgid = opts->setgid,
+        .required_flags = opts->required_flags,
+        .jobs = opts->jobs,
+        .copy = {
+            .uring_depth = opts->uring_depth,
+            .chunk_size = opts->chunk_size,
+            .sparse_always = opts->sparse_always,
+            .direct = opts->direct,
+        },
+        .resume = opts->resume,
+        .verify = opts->verify,
+        .durability = opts->durability,
+    };
+
+    ret = move_file(source, target, &move_opts);
+    if (ret != 0)
+        fsops_fail("Move file");
+    return ret;
+}
@@ -0,0 +1,300 @@
+
+/* ISC License                                                              */
+/*                                                                          */
+/* Copyright (c) 2016, Richard Maw                                          */
+/*                                                                          */
+/* Permission to use, copy, modify, and/or distribute this software for any */
+/* purpose with or without fee is hereby granted, provided that the above   */
+/* copyright notice and this permission notice appear in all copies.        */
+/*                                                                          */
+/* THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES */
+/* WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF         */
+/* MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR  */
+/* ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES   */
+/* WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN    */
+/* ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF  */
+/* OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.           */
+
+#include <stdbool.h>         /* bool, true, false */
+#include <stdlib.h>          /* NULL, calloc, malloc, free */
+#include <string.h>          /* memcpy */
+#include <errno.h>           /* errno, ENOMEM */
+#include <unistd.h>          /* sysconf, _SC_NPROCESSORS_ONLN */
+#include <pthread.h>         /* pthread_* */
+
+#include "pool.h"
+
+/* naive_copy_range keeps its whole read buffer on the stack,
+   so workers need more than the smallest default stack. */
+#define WORKER_STACK_SIZE (16 * 1024 * 1024)
+
+struct pool_task {
+    pool_fn *fn;
+    void *arg;
+};
+
+struct deque {
+    pthread_mutex_t lock;
+    struct pool_task *tasks;
+    size_t cap;                  /* always a power of two */
+    size_t head;                 /* oldest task, taken by thieves */
+    size_t tail;                 /* next free slot, owner pushes and pops */
+};
+
+struct worker {
+    struct pool *pool;
+    struct deque deque;
+    pthread_t thread;
+    unsigned index;
+};
+
+struct pool {
+    struct worker *workers;
+    unsigned nworkers;
+    unsigned next;               /* round-robin target for outside submits */
+    unsigned long queued;        /* tasks sitting in deques */
+    unsigned long pending;       /* tasks submitted but not finished */
+    unsigned idle;               /* workers asleep on work_cond */
+    bool shutdown;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+};
+
+static __thread struct worker *current_worker;
+
+static int deque_push(struct deque *dq, const struct pool_task *task) {
+    int ret = 0;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail - dq->head == dq->cap) {
+        size_t new_cap = dq->cap ? dq->cap * 2 : 64;
+        struct pool_task *new_tasks = malloc(new_cap * sizeof *new_tasks);
+        if (new_tasks == NULL) {
+            ret = -1;
+            goto cleanup;
+        }
+        for (size_t i = dq->head; i != dq->tail; i++)
+            new_tasks[i - dq->head] = dq->tasks[i & (dq->cap - 1)];
+        free(dq->tasks);
+        dq->tasks = new_tasks;
+        dq->tail -= dq->head;
+        dq->head = 0;
+        dq->cap = new_cap;
+    }
+    dq->tasks[dq->tail++ & (dq->cap - 1)] = *task;
+cleanup:
+    pthread_mutex_unlock(&dq->lock);
+    return ret;
+}
+
+static bool deque_pop(struct deque *dq, struct pool_task *task) {
+    bool ret = false;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail != dq->head) {
+        *task = dq->tasks[--dq->tail & (dq->cap - 1)];
+        ret = true;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return ret;
+}
+
+static bool deque_steal(struct deque *dq, struct pool_task *task) {
+    bool ret = false;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail != dq->head) {
+        *task = dq->tasks[dq->head++ & (dq->cap - 1)];
+        ret = true;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return ret;
+}
+
+/* Take a task from self's deque, or steal one from another worker's.
+   Threads that aren't workers of the pool pass NULL and can only steal. */
+static bool take_task(struct pool *pool, struct worker *self,
+                      struct pool_task *task) {
+    unsigned start = self ? self->index : 0;
+
+    if (self != NULL && deque_pop(&self->deque, task))
+        goto found;
+
+    for (unsigned i = self ? 1 : 0; i < pool->nworkers; i++) {
+        struct worker *victim = &pool->workers[(start + i) % pool->nworkers];
+        if (deque_steal(&victim->deque, task))
+            goto found;
+    }
+    return false;
+
+found:
+    __atomic_fetch_sub(&pool->queued, 1, __ATOMIC_SEQ_CST);
+    return true;
+}
+
+static void run_task(struct pool *pool, const struct pool_task *task) {
+    task->fn(pool, task->arg);
+    if (__atomic_fetch_sub(&pool->pending, 1, __ATOMIC_SEQ_CST) == 1) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->done_cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+static void *worker_main(void *arg) {
+    struct worker *self = arg;
+    struct pool *pool = self->pool;
+    current_worker = self;
+
+    for (;;) {
+        struct pool_task task;
+        if (take_task(pool, self, &task)) {
+            run_task(pool, &task);
+            continue;
+        }
+
+        /* idle is raised before queued is checked and submitters raise
+           queued before checking idle, so one of us sees the other. */
+        pthread_mutex_lock(&pool->lock);
+        __atomic_fetch_add(&pool->idle, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0
+               && !pool->shutdown)
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        __atomic_fetch_sub(&pool->idle, 1, __ATOMIC_SEQ_CST);
+        if (pool->shutdown) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+int pool_submit(struct pool *pool, pool_fn *fn, void *arg) {
+    struct pool_task task = { .fn = fn, .arg = arg, };
+    struct worker *target = current_worker;
+    int ret;
+
+    if (target == NULL || target->pool != pool) {
+        unsigned next = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+        target = &pool->workers[next % pool->nworkers];
+    }
+
+    __atomic_fetch_add(&pool->pending, 1, __ATOMIC_SEQ_CST);
+    ret = deque_push(&target->deque, &task);
+    if (ret < 0) {
+        __atomic_fetch_sub(&pool->pending, 1, __ATOMIC_SEQ_CST);
+        return ret;
+    }
+    __atomic_fetch_add(&pool->queued, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->work_cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return 0;
+}
+
+void pool_wait(struct pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) != 0)
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_wait_for(struct pool *pool, unsigned long *outstanding) {
+    struct worker *self = current_worker;
+    if (self != NULL && self->pool != pool)
+        self = NULL;
+
+    while (__atomic_load_n(outstanding, __ATOMIC_SEQ_CST) != 0) {
+        struct pool_task task;
+        if (take_task(pool, self, &task)) {
+            run_task(pool, &task);
+            continue;
+        }
+
+        /* Nothing is queued, so whatever we're waiting for is running
+           and pool_done will wake us when it finishes. */
+        pthread_mutex_lock(&pool->lock);
+        if (__atomic_load_n(outstanding, __ATOMIC_SEQ_CST) != 0
+            && __atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0)
+            pthread_cond_wait(&pool->done_cond, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+void pool_done(struct pool *pool, unsigned long *outstanding) {
+    if (__atomic_fetch_sub(outstanding, 1, __ATOMIC_SEQ_CST) == 1) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->done_cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+struct pool *pool_new(unsigned nthreads) {
+    struct pool *pool = NULL;
+    pthread_attr_t attr;
+    int ret;
+
+    if (nthreads == 0) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpus > 0 ? ncpus : 1;
+    }
+
+    pool = calloc(1, sizeof *pool);
+    if (pool == NULL)
+        return NULL;
+    pool->workers = calloc(nthreads, sizeof *pool->workers);
+    if (pool->workers == NULL) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    for (unsigned i = 0; i < nthreads; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        pthread_mutex_init(&pool->workers[i].deque.lock, NULL);
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, WORKER_STACK_SIZE);
+    for (; pool->nworkers < nthreads; pool->nworkers++) {
+        struct worker *worker = &pool->workers[pool->nworkers];
+        ret = pthread_create(&worker->thread, &attr, worker_main, worker);
+        if (ret != 0) {
+            pthread_attr_destroy(&attr);
+            pool_free(pool);
+            errno = ret;
+            return NULL;
+        }
+    }
+    pthread_attr_destroy(&attr);
+
+    return pool;
+}
+
+void pool_free(struct pool *pool) {
+    if (pool == NULL)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (unsigned i = 0; i < pool->nworkers; i++)
+        pthread_join(pool->workers[i].thread, NULL);
+
+    for (unsigned i = 0; i < pool->nworkers; i++) {
+        pthread_mutex_destroy(&pool->workers[i].deque.lock);
+        free(pool->workers[i].deque.tasks);
+    }
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
@@ -0,0 +1,47 @@
+
+/* ISC License                                                              */
+/*                                                                          */
+/* Copyright (c) 2016, Richard Maw                                          */
+/*                                                                          */
+/* Permission to use, copy, modify, and/or distribute this software for any */
+/* purpose with or without fee is hereby granted, provided that the above   */
+/* copyright notice and this permission notice appear in all copies.        */
+/*                                                                          */
+/* THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES */
+/* WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF         */
+/* MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR  */
+/* ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES   */
+/* WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN    */
+/* ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF  */
+/* OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.           */
+
+/* A fixed-size pool of worker threads.
+   Each worker owns a deque of tasks: tasks submitted from inside a task are
+   pushed onto the submitting worker's deque and popped back LIFO, so a
+   worker descends depth-first through the work it generates, while idle
+   workers steal the oldest task from the other end of someone else's deque.
+ */
+
+struct pool;
+
+typedef void pool_fn(struct pool *pool, void *arg);
+
+/* Start nthreads workers, or one per online CPU if nthreads is 0. */
+struct pool *pool_new(unsigned nthreads);
+
+/* Queue fn(pool, arg) to be run by a worker. */
+int pool_submit(struct pool *pool, pool_fn *fn, void *arg);
+
+/* Block until every submitted task, including tasks they submitted, is done. */
+void pool_wait(struct pool *pool);
+
+/* Run queued tasks on the calling thread until *outstanding drops to 0,
+   so a task can wait for the tasks it submitted without idling a worker.
+   Each of those tasks must call pool_done(pool, outstanding) when finished. */
+void pool_wait_for(struct pool *pool, unsigned long *outstanding);
+
+/* Count one task waited for by pool_wait_for as finished. */
+void pool_done(struct pool *pool, unsigned long *outstanding);
+
+/* Stop the workers. Outstanding tasks must have been waited for. */
+void pool_free(struct pool *pool);
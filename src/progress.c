@@ -0,0 +1,198 @@
+
+/* ISC License                                                              */
+/*                                                                          */
+/* Copyright (c) 2016, Richard Maw                                          */
+/*                                                                          */
+/* Permission to use, copy, modify, and/or distribute this software for any */
+/* purpose with or without fee is hereby granted, provided that the above   */
+/* copyright notice and this permission notice appear in all copies.        */
+/*                                                                          */
+/* THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES */
+/* WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF         */
+/* MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR  */
+/* ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES   */
+/* WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN    */
+/* ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF  */
+/* OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.           */
+
+#include <errno.h>           /* errno */
+#include <pthread.h>         /* pthread_*, PTHREAD_*_INITIALIZER */
+#include <stdbool.h>         /* bool, true, false */
+#include <stdio.h>           /* snprintf, perror */
+#include <string.h>          /* strlen */
+#include <time.h>            /* clock_gettime, struct timespec */
+#include <unistd.h>          /* write, isatty, STDERR_FILENO */
+
+#include "progress.h"
+#include "copy.h"            /* copy_backend_names */
+
+/* Throughput is averaged over roughly this many seconds */
+#define RATE_TIME_CONSTANT 5.0
+
+bool progress_enabled = false;
+unsigned long long progress_bytes;
+unsigned long long progress_total;
+enum copy_backend progress_current_backend = COPY_BACKEND_AUTO;
+
+static struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stop;
+    double interval;
+    int fd;
+    bool tty;                    /* stderr can be redrawn in place */
+    struct timespec started;
+    struct timespec last;
+    unsigned long long last_bytes;
+    double rate;                 /* bytes per second, EWMA */
+} progress = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .fd = -1,
+};
+
+static double timespec_seconds(const struct timespec *ts) {
+    return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+/* Scale bytes to a unit for people to read */
+static const char *human_size(double bytes, double *scaled) {
+    static const char *const units[] = { "B", "KiB", "MiB", "GiB", "TiB", };
+    unsigned unit = 0;
+    while (bytes >= 1024 && unit < sizeof(units) / sizeof(*units) - 1) {
+        bytes /= 1024;
+        unit++;
+    }
+    *scaled = bytes;
+    return units[unit];
+}
+
+static void report(bool final) {
+    struct timespec now;
+    unsigned long long bytes, total;
+    enum copy_backend backend;
+    double dt, eta = -1;
+    char line[256];
+    int len;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    bytes = __atomic_load_n(&progress_bytes, __ATOMIC_RELAXED);
+    total = __atomic_load_n(&progress_total, __ATOMIC_RELAXED);
+    backend = __atomic_load_n(&progress_current_backend, __ATOMIC_RELAXED);
+
+    dt = timespec_seconds(&now) - timespec_seconds(&progress.last);
+    if (dt > 0) {
+        double inst = (bytes - progress.last_bytes) / dt;
+        /* Weight by elapsed time so the average doesn't depend on interval */
+        double alpha = dt / (RATE_TIME_CONSTANT + dt);
+        if (progress.last_bytes == 0 && progress.rate == 0)
+            alpha = 1;
+        progress.rate += alpha * (inst - progress.rate);
+    }
+    progress.last = now;
+    progress.last_bytes = bytes;
+    if (progress.rate > 0 && total > bytes)
+        eta = (total - bytes) / progress.rate;
+
+    if (progress.fd >= 0) {
+        len = snprintf(line, sizeof(line),
+                       "{\"elapsed_seconds\":%.3f,\"bytes\":%llu"
+                       ",\"total_bytes\":%llu,\"bytes_per_second\":%.0f"
+                       ",\"eta_seconds\":%.1f,\"backend\":\"%s\""
+                       ",\"final\":%s}\n",
+                       timespec_seconds(&now)
+                       - timespec_seconds(&progress.started),
+                       bytes, total, progress.rate, eta,
+                       copy_backend_names[backend],
+                       final ? "true" : "false");
+    } else {
+        double done_scaled, total_scaled, rate_scaled;
+        const char *done_unit = human_size(bytes, &done_scaled);
+        const char *total_unit = human_size(total, &total_scaled);
+        const char *rate_unit = human_size(progress.rate, &rate_scaled);
+        char eta_text[32] = "";
+
+        if (eta >= 0)
+            snprintf(eta_text, sizeof(eta_text), "  ETA %ldm%02lds",
+                     (long)eta / 60, (long)eta % 60);
+        len = snprintf(line, sizeof(line),
+                       "%s%.1f %s / %.1f %s  %.1f %s/s%s  %s%s",
+                       progress.tty ? "\r\033[K" : "",
+                       done_scaled, done_unit, total_scaled, total_unit,
+                       rate_scaled, rate_unit, eta_text,
+                       copy_backend_names[backend],
+                       progress.tty && !final ? "" : "\n");
+    }
+    if (len >= (int)sizeof(line))
+        len = sizeof(line) - 1;
+
+    /* Progress is best effort, a full pipe shouldn't stop the copy */
+    (void)!write(progress.fd >= 0 ? progress.fd : STDERR_FILENO, line, len);
+}
+
+static void *progress_main(void *arg) {
+    pthread_mutex_lock(&progress.lock);
+    while (!progress.stop) {
+        struct timespec deadline;
+        int ret = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += (time_t)progress.interval;
+        deadline.tv_nsec += (progress.interval - (time_t)progress.interval)
+                            * 1e9;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        while (!progress.stop && ret != ETIMEDOUT)
+            ret = pthread_cond_timedwait(&progress.cond, &progress.lock,
+                                         &deadline);
+        if (!progress.stop)
+            report(false);
+    }
+    pthread_mutex_unlock(&progress.lock);
+    return NULL;
+}
+
+int progress_start(double interval, int fd) {
+    pthread_condattr_t attr;
+    int ret;
+
+    progress.interval = interval > 0 ? interval : 1;
+    progress.fd = fd;
+    progress.tty = fd < 0 && isatty(STDERR_FILENO);
+    clock_gettime(CLOCK_MONOTONIC, &progress.started);
+    progress.last = progress.started;
+
+    /* The timer runs off the monotonic clock, like the samples */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&progress.cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    progress_enabled = true;
+    ret = pthread_create(&progress.thread, NULL, progress_main, NULL);
+    if (ret != 0) {
+        progress_enabled = false;
+        errno = ret;
+        perror("Start progress reporting");
+        return -1;
+    }
+    return 0;
+}
+
+void progress_stop(void) {
+    if (!progress_enabled)
+        return;
+
+    pthread_mutex_lock(&progress.lock);
+    progress.stop = true;
+    pthread_cond_signal(&progress.cond);
+    pthread_mutex_unlock(&progress.lock);
+    pthread_join(progress.thread, NULL);
+
+    report(true);
+    progress_enabled = false;
+}
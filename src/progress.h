@@ -0,0 +1,63 @@
+
+/* ISC License                                                              */
+/*                                                                          */
+/* Copyright (c) 2016, Richard Maw                                          */
+/*                                                                          */
+/* Permission to use, copy, modify, and/or distribute this software for any */
+/* purpose with or without fee is hereby granted, provided that the above   */
+/* copyright notice and this permission notice appear in all copies.        */
+/*                                                                          */
+/* THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES */
+/* WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF         */
+/* MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR  */
+/* ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES   */
+/* WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN    */
+/* ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF  */
+/* OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.           */
+
+#pragma once
+
+/* Live progress of the bytes being copied.
+   The copy loops only add to atomic counters,
+   which a timer thread samples to report throughput and ETA
+   to stderr, or as JSON lines to another file descriptor. */
+
+#include <stdbool.h>         /* bool */
+
+#include "copy.h"            /* enum copy_backend */
+
+extern bool progress_enabled;
+extern unsigned long long progress_bytes;
+extern unsigned long long progress_total;
+extern enum copy_backend progress_current_backend;
+
+/* Count bytes written to a target. */
+static inline void progress_add(unsigned long long bytes) {
+    if (progress_enabled)
+        __atomic_fetch_add(&progress_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+/* Take back bytes counted by progress_add that are being copied again. */
+static inline void progress_sub(unsigned long long bytes) {
+    if (progress_enabled)
+        __atomic_fetch_sub(&progress_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+/* Count bytes that are going to be copied, for the ETA. */
+static inline void progress_expect(unsigned long long bytes) {
+    if (progress_enabled)
+        __atomic_fetch_add(&progress_total, bytes, __ATOMIC_RELAXED);
+}
+
+static inline void progress_backend(enum copy_backend backend) {
+    if (progress_enabled)
+        __atomic_store_n(&progress_current_backend, backend,
+                         __ATOMIC_RELAXED);
+}
+
+/* Report every interval seconds until progress_stop,
+   as JSON lines to fd, or for people to stderr if fd is -1. */
+int progress_start(double interval, int fd);
+
+/* Stop the timer and write a final report. */
+void progress_stop(void);
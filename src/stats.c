@@ -0,0 +1,129 @@
+
+/* ISC License                                                              */
+/*                                                                          */
+/* Copyright (c) 2016, Richard Maw                                          */
+/*                                                                          */
+/* Permission to use, copy, modify, and/or distribute this software for any */
+/* purpose with or without fee is hereby granted, provided that the above   */
+/* copyright notice and this permission notice appear in all copies.        */
+/*                                                                          */
+/* THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES */
+/* WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF         */
+/* MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR  */
+/* ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES   */
+/* WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN    */
+/* ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF  */
+/* OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.           */
+
+#include <stdbool.h>         /* bool, false */
+#include <stdio.h>           /* FILE, fprintf */
+#include <time.h>            /* clock_gettime, CLOCK_MONOTONIC */
+
+#include "stats.h"
+#include "copy.h"            /* copy_syscalls, copy_backend_names */
+
+bool stats_enabled = false;
+
+static const char *const phase_names[STATS_PHASE_COUNT] = {
+    [STATS_RENAME] = "rename",
+    [STATS_OPEN] = "open",
+    [STATS_SELINUX] = "selinux",
+    [STATS_TMPFILE] = "tmpfile",
+    [STATS_DATA] = "data",
+    [STATS_CHMOD] = "chmod",
+    [STATS_OWNER] = "owner",
+    [STATS_FLAGS] = "flags",
+    [STATS_XATTRS] = "xattrs",
+    [STATS_ACLS] = "acls",
+    [STATS_TIMES] = "times",
+    [STATS_VERIFY] = "verify",
+    [STATS_SYNC] = "sync",
+    [STATS_COMMIT] = "commit",
+    [STATS_SPECIAL] = "special",
+    [STATS_DIR] = "dir",
+    [STATS_HARDLINK] = "hardlink",
+    [STATS_REMOVE] = "remove",
+};
+
+/* Totals are added to atomically by whichever thread ran the phase */
+static struct {
+    unsigned long long count;
+    unsigned long long nsec;
+    unsigned long long syscalls;
+    unsigned long long bytes;
+} phases[STATS_PHASE_COUNT];
+
+static struct {
+    unsigned long long calls;
+    unsigned long long bytes;
+} backends[COPY_BACKEND_COUNT];
+
+static struct timespec started;
+
+static long long timespec_nsec(const struct timespec *ts) {
+    return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+void stats_enable(void) {
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    stats_enabled = true;
+}
+
+void stats_mark_now(struct stats_mark *mark) {
+    clock_gettime(CLOCK_MONOTONIC, &mark->time);
+    mark->syscalls = copy_syscalls;
+}
+
+void stats_add_phase(enum stats_phase phase, struct stats_mark *mark,
+                     unsigned long long bytes) {
+    struct stats_mark now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now.time);
+    now.syscalls = copy_syscalls;
+
+    __atomic_fetch_add(&phases[phase].count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&phases[phase].nsec,
+                       timespec_nsec(&now.time) - timespec_nsec(&mark->time),
+                       __ATOMIC_RELAXED);
+    __atomic_fetch_add(&phases[phase].syscalls,
+                       now.syscalls - mark->syscalls, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&phases[phase].bytes, bytes, __ATOMIC_RELAXED);
+    *mark = now;
+}
+
+void stats_add_backend(enum copy_backend backend, unsigned long long bytes) {
+    __atomic_fetch_add(&backends[backend].calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&backends[backend].bytes, bytes, __ATOMIC_RELAXED);
+}
+
+int stats_report(FILE *fp) {
+    struct timespec now;
+    const char *sep = "";
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    fprintf(fp, "{\"wall_seconds\":%.6f,\"phases\":{",
+            (timespec_nsec(&now) - timespec_nsec(&started)) / 1e9);
+
+    for (int i = 0; i < STATS_PHASE_COUNT; i++) {
+        if (phases[i].count == 0)
+            continue;
+        fprintf(fp, "%s\"%s\":{\"count\":%llu,\"seconds\":%.6f"
+                ",\"syscalls\":%llu,\"bytes\":%llu}",
+                sep, phase_names[i], phases[i].count, phases[i].nsec / 1e9,
+                phases[i].syscalls, phases[i].bytes);
+        sep = ",";
+    }
+
+    fprintf(fp, "},\"backends\":{");
+    sep = "";
+    for (int i = 0; i < COPY_BACKEND_COUNT; i++) {
+        if (backends[i].calls == 0)
+            continue;
+        fprintf(fp, "%s\"%s\":{\"calls\":%llu,\"bytes\":%llu}",
+                sep, copy_backend_names[i], backends[i].calls,
+                backends[i].bytes);
+        sep = ",";
+    }
+
+    return fprintf(fp, "}}\n") < 0 ? -1 : 0;
+}
@@ -0,0 +1,92 @@
+
+/* ISC License                                                              */
+/*                                                                          */
+/* Copyright (c) 2016, Richard Maw                                          */
+/*                                                                          */
+/* Permission to use, copy, modify, and/or distribute this software for any */
+/* purpose with or without fee is hereby granted, provided that the above   */
+/* copyright notice and this permission notice appear in all copies.        */
+/*                                                                          */
+/* THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES */
+/* WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF         */
+/* MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR  */
+/* ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES   */
+/* WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN    */
+/* ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF  */
+/* OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.           */
+
+#pragma once
+
+/* Accounting for the --stats report.
+   Each phase of a move adds up its wall time, system calls and bytes,
+   and copy_range records which backend moved each range.
+   Everything is skipped behind one branch unless stats_enabled is set. */
+
+#include <stdbool.h>         /* bool */
+#include <stdio.h>           /* FILE */
+#include <time.h>            /* struct timespec */
+
+#include "copy.h"            /* copy_syscalls, enum copy_backend */
+
+enum stats_phase {
+    STATS_RENAME,            /* moves done by renaming */
+    STATS_OPEN,              /* opening the source */
+    STATS_SELINUX,           /* looking up and setting create contexts */
+    STATS_TMPFILE,           /* making the file to copy into */
+    STATS_DATA,              /* copy_contents */
+    STATS_CHMOD,
+    STATS_OWNER,
+    STATS_FLAGS,
+    STATS_XATTRS,
+    STATS_ACLS,
+    STATS_TIMES,
+    STATS_VERIFY,            /* waiting for and comparing read backs */
+    STATS_SYNC,              /* making copies durable before committing */
+    STATS_COMMIT,            /* linking or renaming into place */
+    STATS_SPECIAL,           /* recreating symlinks, devices and fifos */
+    STATS_DIR,               /* making directories and their metadata */
+    STATS_HARDLINK,          /* linking further names of copied inodes */
+    STATS_REMOVE,            /* removing sources after copying */
+    STATS_PHASE_COUNT,
+};
+
+/* Count a system call made outside the copy engine. */
+#define STATS_SYSCALL(call) (copy_syscalls++, (call))
+
+struct stats_mark {
+    struct timespec time;
+    unsigned long long syscalls;
+};
+
+extern bool stats_enabled;
+
+/* Turn accounting on and start the clock for the whole run. */
+void stats_enable(void);
+
+void stats_mark_now(struct stats_mark *mark);
+void stats_add_phase(enum stats_phase phase, struct stats_mark *mark,
+                     unsigned long long bytes);
+void stats_add_backend(enum copy_backend backend, unsigned long long bytes);
+
+/* Start timing the phases run after this on the calling thread. */
+static inline void stats_start(struct stats_mark *mark) {
+    if (stats_enabled)
+        stats_mark_now(mark);
+}
+
+/* Account everything since mark to phase and move mark to now. */
+static inline void stats_phase(struct stats_mark *mark,
+                               enum stats_phase phase,
+                               unsigned long long bytes) {
+    if (stats_enabled)
+        stats_add_phase(phase, mark, bytes);
+}
+
+static inline void stats_backend(enum copy_backend backend,
+                                 unsigned long long bytes) {
+    if (stats_enabled)
+        stats_add_backend(backend, bytes);
+}
+
+/* Write the totals as a JSON object. */
+int stats_report(FILE *fp);
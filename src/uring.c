@@ -0,0 +1,473 @@
+
+/* ISC License                                                              */
+/*                                                                          */
+/* Copyright (c) 2016, Richard Maw                                          */
+/*                                                                          */
+/* Permission to use, copy, modify, and/or distribute this software for any */
+/* purpose with or without fee is hereby granted, provided that the above   */
+/* copyright notice and this permission notice appear in all copies.        */
+/*                                                                          */
+/* THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES */
+/* WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF         */
+/* MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR  */
+/* ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES   */
+/* WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN    */
+/* ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF  */
+/* OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.           */
+
+#include <errno.h>           /* errno, E* */
+#include <stdbool.h>         /* bool, true, false */
+#include <stdlib.h>          /* NULL, calloc, free */
+#include <string.h>          /* memset */
+#include <unistd.h>          /* close, syscall */
+#include <sys/types.h>       /* loff_t, size_t, ssize_t */
+
+#include "uring.h"
+
+#if HAVE_LINUX_IO_URING_H
+
+#include <pthread.h>         /* pthread_key_*, pthread_once */
+#include <sys/mman.h>        /* mmap, munmap */
+#include <sys/stat.h>        /* fstat, struct stat, S_ISREG */
+#include <sys/syscall.h>     /* __NR_* */
+#include <sys/uio.h>         /* struct iovec */
+#include <linux/io_uring.h>  /* struct io_uring_*, IORING_*, IOSQE_* */
+
+#include "missing.h"         /* __NR_io_uring_* */
+#include "copy.h"            /* copy_syscalls */
+#include "progress.h"        /* progress_add, progress_sub */
+#include "digest.h"          /* digest_add, digest_skip */
+
+#define CHUNK_SIZE (1024 * 1024)
+
+/* A chunk of the range being copied through one registered buffer.
+   A read is linked to the write of the same buffer,
+   so a short read cancels the write and the chunk is resubmitted
+   from wherever it got to, and a read of nothing means EOF. */
+struct slot {
+    loff_t srcoff;
+    loff_t tgtoff;
+    size_t len;                  /* bytes of the chunk still to copy */
+    size_t have;                 /* bytes read but not yet written */
+    unsigned inflight;           /* submitted but not completed sqes */
+};
+
+struct ring {
+    int fd;
+    unsigned depth;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned to_submit;
+    char *buffers;
+    struct slot *slots;
+};
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static __thread struct ring *thread_ring;
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, const void *arg,
+                             unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void ring_free(struct ring *ring) {
+    if (ring == NULL)
+        return;
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED
+        && ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_size);
+    if (ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED)
+        munmap(ring->sq_ptr, ring->sq_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    if (ring->buffers != NULL && ring->buffers != MAP_FAILED)
+        munmap(ring->buffers, (size_t)ring->depth * CHUNK_SIZE);
+    free(ring->slots);
+    free(ring);
+}
+
+static void ring_key_destroy(void *ring) {
+    ring_free(ring);
+}
+
+static void make_ring_key(void) {
+    (void)pthread_key_create(&ring_key, ring_key_destroy);
+}
+
+static struct ring *ring_new(unsigned depth) {
+    struct io_uring_params p;
+    struct iovec *iovs = NULL;
+    struct ring *ring;
+    int saved_errno;
+
+    ring = calloc(1, sizeof *ring);
+    if (ring == NULL)
+        return NULL;
+    ring->fd = -1;
+    ring->depth = depth;
+
+    /* Every slot can have a read and a write in flight */
+    memset(&p, 0, sizeof p);
+    ring->fd = io_uring_setup(depth * 2, &p);
+    if (ring->fd < 0) {
+        /* Kernel without io_uring, or io_uring disabled by sysctl */
+        if (errno == EPERM)
+            errno = ENOSYS;
+        goto error;
+    }
+
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_size = p.cq_off.cqes
+                    + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size)
+            ring->sq_size = ring->cq_size;
+        ring->cq_size = ring->sq_size;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ|PROT_WRITE,
+                        MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+        goto error;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ|PROT_WRITE,
+                            MAP_SHARED|MAP_POPULATE, ring->fd,
+                            IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED)
+            goto error;
+    }
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ|PROT_WRITE,
+                      MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto error;
+
+    ring->sq_head = (unsigned *)((char *)ring->sq_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ptr + p.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr
+                                         + p.cq_off.cqes);
+
+    ring->buffers = mmap(NULL, (size_t)depth * CHUNK_SIZE,
+                         PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS,
+                         -1, 0);
+    if (ring->buffers == MAP_FAILED)
+        goto error;
+    ring->slots = calloc(depth, sizeof *ring->slots);
+    iovs = calloc(depth, sizeof *iovs);
+    if (ring->slots == NULL || iovs == NULL)
+        goto error;
+    for (unsigned i = 0; i < depth; i++) {
+        iovs[i].iov_base = ring->buffers + (size_t)i * CHUNK_SIZE;
+        iovs[i].iov_len = CHUNK_SIZE;
+    }
+    if (io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, iovs, depth) < 0) {
+        /* Not enough locked memory for the buffers, or a kernel
+           that can't register them, which won't change */
+        errno = ENOSYS;
+        goto error;
+    }
+    free(iovs);
+
+    return ring;
+
+error:
+    saved_errno = errno;
+    free(iovs);
+    ring_free(ring);
+    errno = saved_errno;
+    return NULL;
+}
+
+/* Find this thread's ring, setting one up if needed.
+   Rings are per-thread so workers copying different files don't contend,
+   and are torn down when the thread exits. */
+static struct ring *get_ring(unsigned depth) {
+    struct ring *ring = thread_ring;
+
+    if (ring != NULL && ring->depth == depth)
+        return ring;
+
+    pthread_once(&ring_key_once, make_ring_key);
+    ring_free(ring);
+    thread_ring = NULL;
+    (void)pthread_setspecific(ring_key, NULL);
+
+    ring = ring_new(depth);
+    if (ring == NULL)
+        return NULL;
+    thread_ring = ring;
+    (void)pthread_setspecific(ring_key, ring);
+    return ring;
+}
+
+static struct io_uring_sqe *get_sqe(struct ring *ring) {
+    unsigned tail = *ring->sq_tail + ring->to_submit;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    ring->sq_array[index] = index;
+    ring->to_submit++;
+    memset(sqe, 0, sizeof *sqe);
+    return sqe;
+}
+
+static void prep_rw(struct ring *ring, unsigned opcode, int fd, unsigned slot,
+                    size_t len, loff_t off, unsigned flags, bool is_write) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    sqe->opcode = opcode;
+    sqe->flags = flags;
+    sqe->fd = fd;
+    sqe->off = off;
+    sqe->addr = (unsigned long)(ring->buffers + (size_t)slot * CHUNK_SIZE);
+    sqe->len = len;
+    sqe->buf_index = slot;
+    sqe->user_data = ((__u64)slot << 1) | is_write;
+}
+
+static void submit_chunk(struct ring *ring, unsigned slot, int srcfd,
+                         int tgtfd) {
+    struct slot *s = &ring->slots[slot];
+    prep_rw(ring, IORING_OP_READ_FIXED, srcfd, slot, s->len, s->srcoff,
+            IOSQE_IO_LINK, false);
+    prep_rw(ring, IORING_OP_WRITE_FIXED, tgtfd, slot, s->len, s->tgtoff,
+            0, true);
+    s->inflight += 2;
+}
+
+static void submit_write(struct ring *ring, unsigned slot, int tgtfd) {
+    struct slot *s = &ring->slots[slot];
+    prep_rw(ring, IORING_OP_WRITE_FIXED, tgtfd, slot, s->have, s->tgtoff,
+            0, true);
+    s->inflight++;
+}
+
+/* Hand queued sqes to the kernel and wait for at least min_complete. */
+static int ring_enter(struct ring *ring, unsigned min_complete) {
+    unsigned to_submit = ring->to_submit;
+    int ret;
+
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + to_submit,
+                     __ATOMIC_RELEASE);
+    ring->to_submit = 0;
+
+    while (to_submit > 0 || min_complete > 0) {
+        ret = io_uring_enter(ring->fd, to_submit, min_complete,
+                             min_complete ? IORING_ENTER_GETEVENTS : 0);
+        copy_syscalls++;
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return ret;
+        }
+        to_submit -= ret;
+        /* Only wait once everything has been submitted */
+        if (to_submit > 0)
+            continue;
+        break;
+    }
+    return 0;
+}
+
+ssize_t uring_copy_range(int srcfd, loff_t *srcoff, int tgtfd, loff_t *tgtoff,
+                         size_t range, unsigned depth, unsigned align,
+                         struct digest *digest) {
+    static bool have_uring = true;
+    struct ring *ring;
+    struct stat st;
+    loff_t next_srcoff, next_tgtoff;
+    size_t remaining;
+    size_t copied = 0;
+    unsigned inflight = 0;
+    bool eof = false;
+    int err = 0;
+
+    if (!__atomic_load_n(&have_uring, __ATOMIC_RELAXED) || depth == 0) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    /* Requests O_DIRECT would refuse aren't made at all,
+       so they can be copied some other way */
+    if (align != 0 && (*srcoff % align != 0 || *tgtoff % align != 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Only worth queueing reads when we know where the data ends */
+    if (fstat(srcfd, &st) < 0)
+        return -1;
+    if (!S_ISREG(st.st_mode)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (*srcoff >= st.st_size)
+        return 0;
+    if (range > st.st_size - *srcoff)
+        range = st.st_size - *srcoff;
+    if (align != 0)
+        range = range / align * align;
+    if (range == 0)
+        return 0;
+
+    ring = get_ring(depth);
+    if (ring == NULL) {
+        /* Only a ring that can never be set up turns io_uring off,
+           running short of memory for one just skips it this time */
+        if (errno == ENOSYS)
+            __atomic_store_n(&have_uring, false, __ATOMIC_RELAXED);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    next_srcoff = *srcoff;
+    next_tgtoff = *tgtoff;
+    remaining = range;
+    for (unsigned i = 0; i < depth && remaining > 0; i++) {
+        struct slot *s = &ring->slots[i];
+        s->srcoff = next_srcoff;
+        s->tgtoff = next_tgtoff;
+        s->len = remaining < CHUNK_SIZE ? remaining : CHUNK_SIZE;
+        s->have = 0;
+        s->inflight = 0;
+        next_srcoff += s->len;
+        next_tgtoff += s->len;
+        remaining -= s->len;
+        submit_chunk(ring, i, srcfd, tgtfd);
+        inflight += 2;
+    }
+
+    while (inflight > 0) {
+        unsigned head, tail;
+
+        if (ring_enter(ring, 1) < 0) {
+            /* Closing the ring is the only way to be sure the kernel is done
+               with buffers we can't wait for */
+            err = errno;
+            ring_free(ring);
+            thread_ring = NULL;
+            (void)pthread_setspecific(ring_key, NULL);
+            break;
+        }
+
+        head = *ring->cq_head;
+        tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            unsigned slot = cqe->user_data >> 1;
+            bool is_write = cqe->user_data & 1;
+            int res = cqe->res;
+            struct slot *s = &ring->slots[slot];
+
+            s->inflight--;
+            inflight--;
+
+            if (!is_write) {
+                if (res < 0) {
+                    if (err == 0)
+                        err = -res;
+                } else {
+                    s->have = res;
+                    if (res == 0)
+                        eof = true;
+                }
+                continue;
+            }
+
+            if (res == -ECANCELED) {
+                /* The read came up short, write what it did get */
+                if (err == 0 && s->have > 0) {
+                    submit_write(ring, slot, tgtfd);
+                    inflight++;
+                }
+                continue;
+            }
+            if (res <= 0) {
+                if (err == 0)
+                    err = res < 0 ? -res : EIO;
+                continue;
+            }
+
+            copied += res;
+            progress_add(res);
+            /* The buffer isn't reused until the chunk is resubmitted */
+            if (digest != NULL)
+                digest_add(digest, s->srcoff,
+                           ring->buffers + (size_t)slot * CHUNK_SIZE, res);
+            s->srcoff += res;
+            s->tgtoff += res;
+            s->len -= res;
+            s->have = 0;
+            if (err != 0)
+                continue;
+
+            if (s->len == 0 && !eof && remaining > 0) {
+                s->srcoff = next_srcoff;
+                s->tgtoff = next_tgtoff;
+                s->len = remaining < CHUNK_SIZE ? remaining : CHUNK_SIZE;
+                next_srcoff += s->len;
+                next_tgtoff += s->len;
+                remaining -= s->len;
+            }
+            /* A remainder is resubmitted even after EOF was seen elsewhere,
+               since EOF is only known to be past where that read was */
+            if (s->len > 0) {
+                submit_chunk(ring, slot, srcfd, tgtfd);
+                inflight += 2;
+            }
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    if (err != 0) {
+        /* Chunks finish out of order, so the caller copies the whole range
+           again, and what was added for them would cancel out when added
+           again. Have the source read back instead. */
+        if (copied > 0) {
+            progress_sub(copied);
+            if (digest != NULL)
+                digest_skip(digest);
+        }
+        errno = err;
+        return -1;
+    }
+
+    *srcoff += copied;
+    *tgtoff += copied;
+    return copied;
+}
+
+#else
+
+ssize_t uring_copy_range(int srcfd, loff_t *srcoff, int tgtfd, loff_t *tgtoff,
+                         size_t range, unsigned depth, unsigned align,
+                         struct digest *digest) {
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,36 @@
+
+/* ISC License                                                              */
+/*                                                                          */
+/* Copyright (c) 2016, Richard Maw                                          */
+/*                                                                          */
+/* Permission to use, copy, modify, and/or distribute this software for any */
+/* purpose with or without fee is hereby granted, provided that the above   */
+/* copyright notice and this permission notice appear in all copies.        */
+/*                                                                          */
+/* THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES */
+/* WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF         */
+/* MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR  */
+/* ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES   */
+/* WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN    */
+/* ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF  */
+/* OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.           */
+
+#include <sys/types.h>       /* loff_t, size_t, ssize_t */
+
+struct digest;
+
+/* Copy up to range bytes from srcfd at *srcoff to tgtfd at *tgtoff
+   through an io_uring with depth registered buffers in flight,
+   each a linked read and write at explicit offsets.
+   Offsets are advanced past what was copied.
+   What's written is added to digest unless it's NULL.
+   If align isn't 0, as for files opened with O_DIRECT, the offsets must
+   be multiples of it and only whole multiples of it are copied,
+   leaving the rest of a range that isn't to the caller.
+   Returns the number of bytes copied, which is short only at EOF
+   or for alignment, or -1 with errno set and nothing committed
+   to the offsets: ENOSYS if io_uring can't be used now, or EINVAL
+   or EOPNOTSUPP if it can't be used for these files or offsets. */
+ssize_t uring_copy_range(int srcfd, loff_t *srcoff, int tgtfd, loff_t *tgtoff,
+                         size_t range, unsigned depth, unsigned align,
+                         struct digest *digest);
@@ -0,0 +1,101 @@
+
+/* ISC License                                                              */
+/*                                                                          */
+/* Copyright (c) 2016, Richard Maw                                          */
+/*                                                                          */
+/* Permission to use, copy, modify, and/or distribute this software for any */
+/* purpose with or without fee is hereby granted, provided that the above   */
+/* copyright notice and this permission notice appear in all copies.        */
+/*                                                                          */
+/* THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES */
+/* WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF         */
+/* MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR  */
+/* ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES   */
+/* WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN    */
+/* ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF  */
+/* OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.           */
+
+#include <stdbool.h>         /* bool, true, false */
+#include <stdint.h>          /* uint64_t */
+#include <string.h>          /* memcpy */
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>       /* _mm*_* */
+#endif
+
+#include "zero.h"
+
+typedef bool zero_fn(const unsigned char *buf, size_t len);
+
+static bool scalar_is_zero(const unsigned char *buf, size_t len) {
+    uint64_t acc = 0;
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        uint64_t w[4];
+        memcpy(w, buf + i, sizeof w);
+        if ((w[0] | w[1] | w[2] | w[3]) != 0)
+            return false;
+    }
+    for (; i < len; i++)
+        acc |= buf[i];
+    return acc == 0;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static bool sse2_is_zero(const unsigned char *buf, size_t len) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 64 <= len; i += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(buf + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(buf + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(buf + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(buf + i + 48));
+        __m128i acc = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff)
+            return false;
+    }
+    return scalar_is_zero(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static bool avx2_is_zero(const unsigned char *buf, size_t len) {
+    size_t i = 0;
+
+    for (; i + 128 <= len; i += 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(buf + i + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(buf + i + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(buf + i + 96));
+        __m256i acc = _mm256_or_si256(_mm256_or_si256(a, b),
+                                      _mm256_or_si256(c, d));
+        if (!_mm256_testz_si256(acc, acc))
+            return false;
+    }
+    return scalar_is_zero(buf + i, len - i);
+}
+#endif
+
+/* Chosen on first use, racing threads all choose the same one */
+static zero_fn *is_zero;
+
+static zero_fn *choose_is_zero(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return avx2_is_zero;
+    if (__builtin_cpu_supports("sse2"))
+        return sse2_is_zero;
+#endif
+    return scalar_is_zero;
+}
+
+bool buf_is_zero(const void *buf, size_t len) {
+    zero_fn *fn = __atomic_load_n(&is_zero, __ATOMIC_RELAXED);
+    if (fn == NULL) {
+        fn = choose_is_zero();
+        __atomic_store_n(&is_zero, fn, __ATOMIC_RELAXED);
+    }
+    return fn(buf, len);
+}